@@ -1,13 +1,52 @@
+/* feature test macros */
+#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
+// expose POSIX/GNU extensions such as getline(), mmap() and madvise()
+
 /* #includes */
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+// for the open() flags
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+// for the SSE2 and AVX2 intrinsics of the scanning kernels
+#endif
+#include <libgen.h>
+// for dirname() to find the directory a file is saved in
+#include <limits.h>
+// for IOV_MAX, the most buffers one writev() takes
+#include <locale.h>
+// for setlocale() so wcwidth() knows the widths of UTF-8 characters
+#include <poll.h>
+// for poll() which waits for input, signals and timers at once
+#include <pthread.h>
+// for the threads that do slow work in the background
+#include <regex.h>
+// for the POSIX regular expressions of replace all
+#include <signal.h>
+// for sigaction() to catch window size changes
 #include <stdio.h>
+#include <sys/mman.h>
+// for mmap() which maps the file into memory
+#include <sys/inotify.h>
+// for inotify, which says when the open file changes on disk
+#include <sys/stat.h>
+// for fstat() which gives the file size
 #include <sys/ioctl.h>
 // ioctl provides terminal size
+#include <sys/resource.h>
+// for getrusage() which gives the peak memory use of a headless run
 #include <sys/types.h>
 // for the open() function
+#include <sys/uio.h>
+// for writev() which writes many buffers with one call
+#include <sys/wait.h>
+// for waitpid() which collects a filter command when it is done
 #include <stdarg.h>
 // used for argument lists
+#include <stdint.h>
+// for the fixed width hash of a screen line
 #include <stdlib.h>
 // for the atexit() function
 #include <string.h>
@@ -20,6 +59,8 @@
 #include <unistd.h>
 // unistd.h is a header file that provides access to the POSIX operating system
 // API.
+#include <wchar.h>
+// for wcwidth() which gives the screen width of a character
 
 char *my_strdup(const char *s) {
   // due to lack of strdup() in C89
@@ -32,23 +73,914 @@ char *my_strdup(const char *s) {
   return dup;
 }
 
+int editorCompareDouble(const void *a, const void *b) {
+  // This function will compare two doubles for qsort().
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+double editorNow() {
+  // This function will return a monotonic time in seconds.
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void editorSyncDir(const char *filename) {
+  // This function will flush the directory of filename to disk, so a file
+  // renamed into it is still there after a crash.
+  char *dir = my_strdup(filename);
+  if (dir == NULL)
+    return;
+  int fd = open(dirname(dir), O_RDONLY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  free(dir);
+}
+
+int editorNonblock(int fd) {
+  // This function will make reads and writes of fd return instead of
+  // waiting, keeping its other flags. It returns -1 when that failed.
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1)
+    return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
 /* data */
+#define RX_INDEX_BITS 21
+// RX_INDEX_BITS is the width of editor_row.rxi, at most 2^21 - 1 long rows
+// have a column index at the same time.
+
 typedef struct editor_row {
-  // data type for the row
-  int size;
-  int rsize;
-  // rsize is the size of the rendered row
+  // data type for the row. There is no rendered copy of the row, the part
+  // that is on screen is expanded from chars every time it is drawn. The
+  // fields are packed into 16 bytes, a file of short lines has more rows
+  // than anything else.
   char *chars;
-  char *render;
-  // render is the rendered row
+  unsigned int size : 31;
+  unsigned int owned : 1;
+  // owned is 0 while chars is a view into the mapped file and 1 once the row
+  // has been copied into its own arena block.
+  unsigned int rxi : RX_INDEX_BITS;
+  // rxi is 1 + the position in E.rxidx of the column index of a long row, or
+  // 0 when the row has none.
+  unsigned int cls : 5;
+  // cls is the arena size class of chars.
+  unsigned int pinned : 1;
+  // pinned is set while a background save is still reading chars, the row
+  // must then be copied before it is changed.
+  unsigned int shared : 1;
+  // shared is set for a view into a text block, see editorTextStore().
+  unsigned int hlstate : 4;
+  // hlstate is the state of the syntax highlighter at the end of the row.
 } editor_row;
 
+#define RX_CHECKPOINT 256
+// RX_CHECKPOINT is how many bytes apart the checkpoints of a column index are.
+#define RX_INDEX_MIN 1024
+// rows shorter than RX_INDEX_MIN bytes are simply walked and get no index.
+
+typedef struct rx_checkpoint {
+  int off;
+  int rx;
+  // rx is the screen column of byte off of the row, off is the first
+  // character boundary at or after a multiple of RX_CHECKPOINT.
+} rx_checkpoint;
+
+typedef struct rx_index {
+  // The column index of a long row. It is built lazily, as far as it has
+  // been needed, and an edit only throws away the checkpoints after it.
+  rx_checkpoint *cp;
+  int valid;
+  int cap;
+  // cp[0] to cp[valid - 1] are up to date.
+  int next;
+  // next links unused entries of E.rxidx together.
+} rx_index;
+
+#define ARENA_MIN_BLOCK 16
+#define ARENA_CLASSES 32
+// blocks come in ARENA_CLASSES power of two sizes starting at ARENA_MIN_BLOCK.
+#define ARENA_FIRST_CHUNK (64 * 1024)
+#define ARENA_MAX_CHUNK (16 * 1024 * 1024)
+// chunks start at ARENA_FIRST_CHUNK and double until ARENA_MAX_CHUNK.
+#define ARENA_BIG_BLOCK (1024 * 1024)
+// blocks larger than ARENA_BIG_BLOCK get a chunk of their own that is given
+// back to the system as soon as the block is released.
+
+typedef struct arena_chunk {
+  // header in front of every chunk the arena got from malloc().
+  struct arena_chunk *prev;
+  struct arena_chunk *next;
+  size_t size;
+  size_t pad;
+  // pad keeps the memory after the header 16 byte aligned.
+} arena_chunk;
+
+typedef struct arena {
+  // The arena hands out power of two sized blocks carved from large chunks.
+  // Released blocks go on a free list per size class and are reused, and
+  // the whole arena is given back with one call to arenaFreeAll().
+  arena_chunk *chunks;
+  char *cur;
+  size_t left;
+  // cur and left describe the unused tail of the newest chunk.
+  size_t chunksize;
+  // chunksize is the size of the next chunk, it grows geometrically.
+  void *freelist[ARENA_CLASSES];
+  long mallocs;
+  long blocks;
+  size_t bytes;
+  // mallocs, blocks and bytes count the chunks taken from the system, the
+  // blocks handed out and the bytes held by the arena.
+} arena;
+
+#define BUF_LEAF_ROWS 254
+// BUF_LEAF_ROWS is the number of rows stored together in one buffer node. 254
+// rows plus the node header make a node of 4096 bytes, one arena class.
+
+typedef struct buf_node {
+  // The rows of the file are kept in a rope: a treap of nodes where every node
+  // holds a small block of consecutive rows. Walking the tree in order gives
+  // the rows of the file in order, and count lets a row be found by its
+  // index in O(log n).
+  struct buf_node *left;
+  struct buf_node *right;
+  unsigned int prio;
+  // prio is the random treap priority that keeps the tree balanced.
+  int count;
+  // count is the number of rows in this node and both of its subtrees.
+  int nrows;
+  // nrows is the number of rows held in this node.
+  editor_row rows[BUF_LEAF_ROWS];
+} buf_node;
+
+#define TEXT_BLOCK_BYTES (256 * 1024)
+// TEXT_BLOCK_BYTES is the size of the blocks rows made in bulk are stored in,
+// and their alignment. Rows longer than TEXT_ROW_MAX get arena blocks.
+#define TEXT_ROW_MAX (TEXT_BLOCK_BYTES / 16)
+
+typedef struct text_block {
+  // header at the start of every text block. The rows of a block follow each
+  // other, each with a line break after it like the lines of a file.
+  struct text_block *prev;
+  struct text_block *next;
+  size_t used;
+  long live;
+  // used counts the bytes taken, header included, and live the rows that
+  // are views into the block. A block nobody looks at is given back.
+} text_block;
+
+#define INPUT_RING_SIZE (64 * 1024)
+// INPUT_RING_SIZE is the size of the ring buffer raw input is read into, it
+// must be a power of two.
+#define KEY_QUEUE_SIZE 4096
+// KEY_QUEUE_SIZE is how many decoded keys can wait to be processed.
+#define ESC_TIMEOUT_MS 50
+// ESC_TIMEOUT_MS is how long the rest of an escape sequence is waited for
+// before the escape counts as a key of its own.
+#define STATUS_MSG_SECONDS 5
+// STATUS_MSG_SECONDS is how long a status message stays in the message bar.
+
+#define SAVE_BACKGROUND_BYTES (8 * 1024 * 1024)
+// files larger than SAVE_BACKGROUND_BYTES are saved on a background thread.
+
+typedef struct journal_region {
+  // Bytes of the file on disk that are in memory as well and never change:
+  // the mapping of the file, or the rows a save wrote that were views.
+  const char *ptr;
+  off_t off;
+  size_t len;
+  int nl;
+  // off is where the bytes are in the file, nl is set when the file has a
+  // line break right after them.
+} journal_region;
+
+typedef struct save_job {
+  // A save in progress. The rows are gathered into iov when the save starts,
+  // so the saving thread never looks at the live buffer.
+  char *filename;
+  struct iovec *iov;
+  int iovcnt;
+  int iovcap;
+  journal_region *regions;
+  int nregions;
+  int regioncap;
+  // regions are the views among the rows and where they end up in the file,
+  // they become the regions of the journal once the save worked.
+  size_t total;
+  // total is the number of bytes the file will have.
+  long dirty;
+  // dirty is the number of edits the snapshot includes.
+  void **deferred;
+  int *deferredcls;
+  int ndeferred;
+  int deferredcap;
+  // deferred holds the arena blocks of pinned rows that were freed during the
+  // save. They are released once the save no longer reads them.
+  pthread_mutex_t lock;
+  size_t written;
+  int done;
+  int err;
+  // written, done and err are updated by the saving thread under lock.
+  double start;
+  // start is when the save began, for the throughput.
+} save_job;
+
+#define LOAD_CHUNK_BYTES (16 * 1024 * 1024)
+// LOAD_CHUNK_BYTES is the size of the pieces a mapped file is split into to
+// find its line breaks in parallel. It must be a multiple of the page size.
+#define LOAD_MAX_THREADS 32
+// LOAD_MAX_THREADS is the most worker threads used to index or search a file.
+#define LOAD_PUBLISH_ROWS (256 * 1024)
+// LOAD_PUBLISH_ROWS is how many indexed rows are added to the buffer before
+// the screen is updated and input is looked at again.
+
+typedef struct load_chunk {
+  // The line breaks found in one chunk of the file.
+  uint32_t *eol;
+  int neol;
+  int cap;
+  // eol holds the offsets of the newlines relative to the start of the chunk.
+  int done;
+  // done is set under the lock of the load once eol is complete.
+} load_chunk;
+
+typedef struct load_job {
+  // A file being indexed. Worker threads take chunks in any order and find
+  // their line breaks, the main thread turns them into rows strictly in
+  // order so the rows of the file come out right.
+  load_chunk *chunks;
+  int nchunks;
+  int nextchunk;
+  // nextchunk is the next chunk a thread will take, under lock.
+  pthread_t *threads;
+  int nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  // ready is signalled every time a chunk is done.
+  int pubchunk;
+  int pubeol;
+  size_t linestart;
+  // pubchunk and pubeol are the next line break to become a row, and
+  // linestart is the offset in the mapping where that row starts.
+  double start;
+  // start is when the file was opened, for the report at the end.
+} load_job;
+
+#define STREAM_BLOCK_BYTES (4 * 1024 * 1024)
+// STREAM_BLOCK_BYTES is the size of the blocks a pipe is read into. The rows
+// read are views into the blocks, like the rows of a mapped file.
+#define STREAM_TURN_BYTES (4 * 1024 * 1024)
+// STREAM_TURN_BYTES is the most read from a pipe before the screen is updated
+// and the keys are looked at again.
+#define STREAM_PIPE_BYTES (1024 * 1024)
+// STREAM_PIPE_BYTES is the size the pipe is asked to have, so a fast writer
+// fills it in large pieces.
+#define STREAM_DEFAULT_MB 1024
+// STREAM_DEFAULT_MB is how much of a pipe is read before reading stops. The
+// writer then waits on the full pipe instead of the editor growing.
+
+typedef struct stream_block {
+  // header in front of every block a pipe is read into.
+  struct stream_block *next;
+  size_t size;
+  size_t used;
+  size_t start;
+  // start is where the line the next line break ends begins.
+} stream_block;
+
+typedef struct stream_job {
+  // A pipe, usually standard input, being read into the buffer while the
+  // editor is in use. Only complete lines become rows, the unfinished one
+  // waits at the end of the newest block.
+  int fd;
+  // fd is the pipe, -1 once it has been read to the end.
+  stream_block *head;
+  stream_block *tail;
+  size_t bytes;
+  size_t limit;
+  int paused;
+  // bytes counts what was read, paused is set once it reached limit.
+  double start;
+} stream_job;
+
+#define FILTER_CHUNK_BYTES (256 * 1024)
+// FILTER_CHUNK_BYTES is how much output of a filter command is read at once.
+#define FILTER_UNDO_BYTES (64 * 1024)
+// FILTER_UNDO_BYTES is about how much text one undo record of a filter holds.
+
+typedef struct filter_job {
+  // A command rows are piped through, see editorFilter().
+  pid_t pid;
+  int in;
+  int out;
+  // in is the pipe to the command and out the pipe from it, -1 once closed.
+  int next;
+  int last;
+  // next is the next row to send and last the last row to send.
+  struct iovec *iov;
+  int iovat;
+  int iovcnt;
+  // iov holds the rows being sent, those from iovat on are not written yet.
+  char *buf;
+  size_t len;
+  size_t cap;
+  // buf holds output that is not a whole line yet.
+  int at;
+  int rows;
+  // at is where the next row of output goes, rows counts the rows made.
+  size_t bytes;
+  // bytes counts the rows sent and made, with their line breaks.
+} filter_job;
+
+#define PAGED_PAGE_BYTES (64 * 1024)
+// PAGED_PAGE_BYTES is the size of the pieces a paged file is read in.
+#define PAGED_INDEX_EVERY 1024
+// PAGED_INDEX_EVERY is how many rows apart the offsets in the line index are.
+#define PAGED_ROW_SLOTS 256
+// PAGED_ROW_SLOTS is how many rows of a paged file are kept ready to draw.
+#define PAGED_MAX_ROW (64 * 1024)
+// PAGED_MAX_ROW is the most bytes of a row a paged file shows, the rest of a
+// longer row is cut off.
+#define PAGED_DEFAULT_CACHE_MB 64
+// PAGED_DEFAULT_CACHE_MB is the default memory limit of the page cache.
+#define PAGED_INDEX_BLOCK (1024 * 1024)
+// PAGED_INDEX_BLOCK is how much of the file the indexer reads at a time.
+
+typedef struct paged_page {
+  // A piece of a paged file held in memory.
+  long long no;
+  // no is the number of the page in the file, the page starts at byte
+  // no * PAGED_PAGE_BYTES.
+  char *data;
+  int len;
+  struct paged_page *prev;
+  struct paged_page *next;
+  // prev and next link the pages from most to least recently used.
+  struct paged_page *hnext;
+  // hnext is the next page in the same bucket of the hash table.
+} paged_page;
+
+typedef struct paged_file {
+  // A file too large to load, viewed through a small cache of pages. Only
+  // the offset of every PAGED_INDEX_EVERY-th row is kept, the rows in
+  // between are found by reading forward from there.
+  int fd;
+  off_t size;
+  paged_page *pages;
+  int npages;
+  int used;
+  // pages holds the npages pages the cache may have, used of them are filled.
+  paged_page **hash;
+  int hashmask;
+  paged_page *mru;
+  paged_page *lru;
+  long long hits;
+  long long misses;
+  off_t *index;
+  int nindex;
+  int indexcap;
+  // index[k] is the offset of row k * PAGED_INDEX_EVERY.
+  int nlines;
+  off_t scanned;
+  int done;
+  int partial;
+  // nlines is the number of complete rows found in the first scanned bytes
+  // of the file, done is set when the whole file is indexed and partial when
+  // the last row counted has no line break after it yet. The index and
+  // these fields are shared with the indexing thread and used under lock.
+  off_t from;
+  // from is where the indexer started, 0 unless the file grew since.
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  int indexing;
+  int percent;
+  // indexing is set until the indexing thread is joined, percent is how far
+  // it got at the last update. Both belong to the main thread.
+  editor_row rows[PAGED_ROW_SLOTS];
+  int rowat[PAGED_ROW_SLOTS];
+  // rows holds the rows read last, the row with index at goes in slot
+  // at % PAGED_ROW_SLOTS and rowat says which row a slot holds.
+  int nextrow;
+  off_t nextoff;
+  // nextrow starts at nextoff, where the last row read ended. Reading the
+  // rows of the screen one after the other continues from there.
+} paged_file;
+
+#define WATCH_TAIL_BYTES 64
+// WATCH_TAIL_BYTES is how many bytes at the end of the file are kept to tell
+// a file that was appended to from one that was rewritten.
+#define WATCH_APPEND_BYTES (16 * 1024 * 1024)
+// WATCH_APPEND_BYTES is the most of an appended tail read in one go, a
+// bigger one is read over several turns of the event loop.
+#define WATCH_RETRY_MS 100
+// WATCH_RETRY_MS is how soon a change is looked at again when it came in
+// while the buffer was busy.
+
+typedef struct file_watch {
+  // The file on disk as far as the buffer holds it. inotify says when the
+  // file changes, the file itself then says whether it only grew.
+  int fd;
+  int wd;
+  int dirwd;
+  // fd is the inotify instance or -1, wd watches the file and dirwd its
+  // directory, for a new file put in its place.
+  off_t size;
+  dev_t dev;
+  ino_t ino;
+  // the buffer holds the first size bytes of the file dev and ino.
+  char tail[WATCH_TAIL_BYTES];
+  int taillen;
+  // tail holds the last taillen of those bytes, a rewrite changes them.
+  int open;
+  // open is set when those bytes do not end in a line break, the last row
+  // then goes on in the next bytes appended.
+  int pending;
+  // pending is set while a change is waiting for the buffer to be free.
+  int stale;
+  // stale is set once the file changed under unsaved edits, it is left
+  // alone from then on until the next save.
+  int follow;
+  // follow keeps the cursor on the last row as the file grows, Ctrl-E.
+} file_watch;
+
+#define FIND_UNIT_ROWS 16384
+// FIND_UNIT_ROWS is about how many rows a search thread takes at a time.
+#define FIND_BLOCK (1024 * 1024)
+// FIND_BLOCK is how much of a paged file a search thread reads at a time.
+
+typedef struct find_match {
+  int row;
+  int col;
+  // col is the byte offset of the match in the row.
+} find_match;
+
+typedef struct find_unit {
+  // A run of consecutive rows searched by one thread in one go.
+  int first;
+  int nrows;
+  int node;
+  int nnodes;
+  // node and nnodes are the buffer nodes of the rows in E.find.nodes.
+  off_t start;
+  // start is where the rows begin in a paged file.
+  find_match *m;
+  int n;
+  int cap;
+  // m holds the matches of the rows in order.
+  int done;
+  // done is set under the lock of the search once m is complete.
+} find_unit;
+
+typedef struct find_job {
+  // A search in progress. The rows are split into units that the threads
+  // take in order starting from the cursor, so the matches near the cursor
+  // are there first. The matches of every unit are kept until the search
+  // ends, so moving between them and highlighting them does not look at the
+  // rows again.
+  char *query;
+  int qlen;
+  buf_node **nodes;
+  int nnodes;
+  int nodecap;
+  // nodes lists the nodes of the buffer in order when the search started.
+  find_unit *units;
+  int nunits;
+  int unitcap;
+  int startunit;
+  int nextunit;
+  // nextunit counts the units handed out, under lock.
+  int cancel;
+  // cancel tells the threads to stop, it is read and written atomically.
+  pthread_t *threads;
+  int nthreads;
+  int running;
+  // running is set until the threads of the search are joined.
+  pthread_mutex_t lock;
+  int ndone;
+  long long nmatches;
+  // ndone and nmatches count the finished units and their matches.
+  int want;
+  int wantrow;
+  int wantcol;
+  int dir;
+  // want is set while the cursor is waiting to jump to the first match at
+  // or after (dir 1), or at or before (dir -1), wantrow and wantcol.
+  int active;
+  // active is set while the search prompt is open and matches are shown.
+  int savedcx;
+  int savedcy;
+  int savedrof;
+  int savedcof;
+  // the cursor and offsets when the search prompt opened.
+} find_job;
+
+#define REPLACE_MAX_GROUPS 10
+// REPLACE_MAX_GROUPS is how many groups, \0 to \9, a replacement can use.
+
+typedef struct replace_row {
+  // A row that replace all changed.
+  int node;
+  int row;
+  // row is the index of the row in job->nodes[node].
+  size_t off;
+  size_t len;
+  // the new contents of the row are len bytes at off in the out buffer of
+  // the unit.
+} replace_row;
+
+typedef struct replace_unit {
+  // A run of consecutive buffer nodes handled by one thread in one go.
+  int node;
+  int nnodes;
+  char *out;
+  size_t outlen;
+  size_t outcap;
+  // out holds the new contents of every changed row of the unit.
+  replace_row *rows;
+  int n;
+  int cap;
+  long long nmatches;
+} replace_unit;
+
+typedef struct replace_job {
+  // A replace all in progress. Every thread matches the rows of the units it
+  // takes and builds their new contents, the main thread then puts them in
+  // the buffer.
+  const char *pattern;
+  const char *with;
+  buf_node **nodes;
+  int nnodes;
+  int nodecap;
+  replace_unit *units;
+  int nunits;
+  int unitcap;
+  int nextunit;
+  // nextunit counts the units handed out, under lock.
+  pthread_mutex_t lock;
+} replace_job;
+
+#define UNDO_CHUNK_BYTES (64 * 1024)
+// UNDO_CHUNK_BYTES is the size of the chunks the undo log is kept in.
+#define UNDO_DEFAULT_MB 64
+// UNDO_DEFAULT_MB is how much memory the undo history may use by default.
+
+enum undoType {
+  UNDO_INSERT,
+  UNDO_DELETE,
+  UNDO_ADD_ROW
+  // UNDO_ADD_ROW is the empty row added when typing after the last row.
+};
+
+typedef struct undo_chunk {
+  // header in front of every chunk of the undo log.
+  struct undo_chunk *next;
+  long long seq;
+  // seq numbers the chunks in the order they were made.
+  size_t size;
+  size_t used;
+} undo_chunk;
+
+typedef struct undo_op {
+  // One recorded change. A break between two rows is a \n in text.
+  int type;
+  int row;
+  int col;
+  int len;
+  char *text;
+  long long chunk;
+  // text is in the chunk of the log numbered chunk.
+  long group;
+  // the records of one edit share a group.
+  int cx;
+  int cy;
+  // the cursor before the change.
+} undo_op;
+
+typedef struct undo_log {
+  // The undo history, records in ops and their text in a list of chunks.
+  undo_chunk *head;
+  undo_chunk *tail;
+  long long nextseq;
+  undo_op *ops;
+  int first;
+  int cur;
+  int n;
+  int cap;
+  // the records from first to cur can be undone, from cur to n redone.
+  size_t bytes;
+  size_t limit;
+  // bytes is the memory the history holds, limit how much it may hold.
+  long group;
+  long dropped;
+  // dropped is the edit that did not fit in the history on its own, the
+  // history was cleared for it and the rest of its records are not kept.
+  int merge;
+  // merge is set while the next typed character may join the last record.
+  int applying;
+  // applying is set while undoing or redoing, nothing is recorded then.
+} undo_log;
+
+typedef struct macro {
+  // A keyboard macro, the keys typed between two Ctrl-K. A PASTE_KEY is
+  // followed by the length of its text, the texts of the pastes are kept in
+  // text in the order they came.
+  int *keys;
+  int nkeys;
+  int cap;
+  char *text;
+  size_t textlen;
+  size_t textcap;
+  int recording;
+  int playing;
+  // playing is set while the macro is replayed, the whole replay is one
+  // edit then.
+} macro;
+
+#define JOURNAL_SYNC_MS 500
+// JOURNAL_SYNC_MS is how long an edit may wait before it is written to the
+// swap file and flushed to disk. The edits of that time go in one write.
+#define JOURNAL_COMPACT_BYTES (16 * 1024 * 1024)
+// JOURNAL_COMPACT_BYTES is how big the swap file gets before it is
+// compacted. After that it is compacted whenever it doubled in size.
+#define JOURNAL_MAGIC "CEDITSW1"
+
+enum journalType {
+  JOURNAL_INSERT = 1,
+  JOURNAL_DELETE,
+  JOURNAL_ADD_ROW,
+  JOURNAL_DEL_ROW,
+  JOURNAL_HUNK
+  // JOURNAL_HUNK puts its text in place of the lines from byte a to byte b
+  // of the file, see journalCompact().
+};
+
+enum journalJob {
+  JOURNAL_IDLE,
+  JOURNAL_APPEND,
+  JOURNAL_REWRITE,
+  JOURNAL_REMOVE
+};
+
+typedef struct journal_head {
+  // The start of a swap file, which version of the file its edits are for.
+  char magic[8];
+  int64_t size;
+  int64_t sec;
+  int64_t nsec;
+  // size and modification time of the file.
+} journal_head;
+
+typedef struct journal_rec {
+  // The header of one edit in the swap file, the text it inserts follows.
+  // a and b are the row and column of the edit and len the number of bytes
+  // inserted or deleted.
+  uint64_t type;
+  int64_t a;
+  int64_t b;
+  uint64_t len;
+} journal_rec;
+
+typedef struct journal_buf {
+  // A growing block of bytes, like struct abuf but for any size.
+  char *b;
+  size_t len;
+  size_t cap;
+} journal_buf;
+
+typedef struct journal {
+  // The crash recovery journal. Every edit is appended to a swap file next
+  // to the file as it is made, so the edits since the last save can be
+  // replayed on the file after a crash.
+  char *path;
+  int fd;
+  // path is the swap file and fd open on it, -1 when there is none. fd
+  // belongs to the journal thread while a job runs.
+  journal_head head;
+  journal_buf pending;
+  journal_buf sending;
+  // pending holds the records not written yet and sending the ones the
+  // journal thread writes.
+  journal_buf during;
+  int saving;
+  // during holds the records made while a save runs, which saving is set
+  // for. They are the edits the saved file does not have.
+  size_t last;
+  int haslast;
+  // haslast is set when the last record of pending is an insert at last,
+  // which a typed character can join.
+  int active;
+  int rewrite;
+  int remove;
+  // active is set while the edits are recorded. rewrite means pending is a
+  // whole new swap file, remove that the swap file has to go.
+  int off;
+  // off is set when there is no journal at all.
+  double due;
+  // due is when pending has to be written, 0 while it is empty.
+  size_t size;
+  size_t compacted;
+  // size is the size of the swap file and compacted its size after the
+  // last compaction.
+  journal_region *regions;
+  int nregions;
+  // regions say which bytes of the file are in memory, sorted by ptr.
+  char *recover;
+  size_t recoverlen;
+  int checked;
+  // recover holds the swap file found when the file was opened until it is
+  // replayed, checked is set once it was looked for.
+  pthread_t thread;
+  int running;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int job;
+  int err;
+  // job is what the journal thread is doing and err how the last job went,
+  // both under lock.
+} journal;
+
+typedef struct journal_walk {
+  // Where a compaction of the journal is in the buffer.
+  off_t pos;
+  // pos is the byte of the file after the last row that is a line of it.
+  size_t at;
+  int open;
+  // open is set while the rows after pos are text of the hunk at at.
+} journal_walk;
+
+typedef struct journal_hunk {
+  // A hunk of a swap file being recovered, at is where its record is and
+  // first and last the rows it replaces.
+  size_t at;
+  int first;
+  int last;
+} journal_hunk;
+
+enum editorHighlight {
+  HL_NORMAL = 0,
+  HL_COMMENT,
+  HL_KEYWORD,
+  HL_TYPE,
+  HL_STRING,
+  HL_NUMBER,
+  HL_PREPROC,
+  HL_VARIABLE,
+  HL_TIME,
+  HL_ERROR,
+  HL_WARN,
+  HL_INFO,
+  HL_DEBUG,
+  HL_MATCH
+  // HL_MATCH is a match of the search, it is never stored.
+};
+
+enum editorHighlightState {
+  // What the highlighter is in the middle of at the end of a row.
+  HL_STATE_NONE = 0,
+  HL_STATE_COMMENT,
+  HL_STATE_DQUOTE,
+  HL_STATE_SQUOTE,
+  HL_STATE_UNKNOWN = 15
+  // HL_STATE_UNKNOWN is the state of a row that was never lexed, the largest
+  // value editor_row.hlstate holds.
+};
+
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+#define HL_HIGHLIGHT_PREPROC (1 << 2)
+// HL_HIGHLIGHT_PREPROC highlights # directives.
+#define HL_SHELL (1 << 3)
+// HL_SHELL highlights $variables and lets strings span rows.
+#define HL_LOG (1 << 4)
+// HL_LOG highlights time stamps and log levels instead.
+
+typedef struct editor_syntax {
+  // A file type the highlighter knows.
+  char *filetype;
+  char **filematch;
+  char **keywords;
+  char *singleline_comment_start;
+  char *multiline_comment_start;
+  char *multiline_comment_end;
+  int flags;
+} editor_syntax;
+
+#define HL_SLOTS 256
+// HL_SLOTS is how many rows keep their highlight between frames.
+#define HL_ROW_MAX (64 * 1024)
+// rows longer than HL_ROW_MAX bytes, like a minified line, are drawn without
+// highlight and end in no lexer state. Every edit of one would lex it again.
+
+typedef struct hl_slot {
+  // The highlight of the first len bytes of row, valid while gen is the
+  // generation of E.hl.
+  int row;
+  int gen;
+  int len;
+  int cap;
+  unsigned char *hl;
+} hl_slot;
+
+typedef struct hl_cache {
+  editor_syntax *syntax;
+  // syntax is the file type of the file, or NULL.
+  int clean;
+  int computed;
+  int dirtyend;
+  // the rows before clean have the right hlstate, the ones before computed
+  // were lexed at some point, and an edit between clean and dirtyend means
+  // lexing has to go on at least until dirtyend.
+  hl_slot slots[HL_SLOTS];
+  int gen;
+  int maxrow;
+  // gen goes up when the slots may be stale, maxrow is the highest row put
+  // in a slot so far.
+} hl_cache;
+
+#ifndef CEDIT_STATS
+#define CEDIT_STATS 1
+#endif
+// CEDIT_STATS=0 compiles the timers and counters of the hot paths out.
+#define STATS_WINDOW 64
+// STATS_WINDOW is how many frames the summary in the message bar covers.
+
+typedef struct frame_stats {
+  // What one frame cost. keys, draw and write are seconds spent handling
+  // the keys, building the frame and writing it out.
+  double keys;
+  double draw;
+  double write;
+  long drawn;
+  long sent;
+  // drawn counts the text rows built, sent the screen lines that changed
+  // and were written.
+  long bytes;
+  long allocs;
+  // allocs counts the blocks taken from the arena.
+} frame_stats;
+
+typedef struct editor_stats {
+  frame_stats cur;
+  // cur is the frame being worked on.
+  frame_stats last[STATS_WINDOW];
+  long frames;
+  int show;
+  // show is set while the summary replaces the message bar, Ctrl-T.
+  FILE *csv;
+  double start;
+  // csv gets a line per frame when --stats-csv is given.
+} editor_stats;
+
+struct abuf {
+  // This is a structure that contains the append buffer.
+  char *b;
+  int len;
+  int cap;
+  // cap is the size of b, it doubles whenever more room is needed.
+};
+
+#define ABUF_MIN 256
+// ABUF_MIN is the size of an append buffer when it first gets memory.
+
+typedef struct output_job {
+  // The frames on their way to the terminal. The main thread builds a frame
+  // and hands it to the output thread, which writes it while the keys go on
+  // being handled. Only one frame is handed over at a time: while it is
+  // being written no new one is drawn, so the frames a slow terminal has no
+  // time for are never made and the next frame shows the latest state.
+  struct abuf frame;
+  struct abuf line;
+  // frame is the frame being built and line one screen line of it, both
+  // are reused for every frame.
+  struct abuf sending;
+  // sending is the frame the output thread writes.
+  pthread_t thread;
+  int running;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int busy;
+  double writetime;
+  // busy is set while sending is being written and writetime adds up the
+  // seconds spent writing, both under lock. cond is signalled when either
+  // side changes busy.
+  int deferred;
+  long skipped;
+  // deferred is set when a frame was skipped because the last one was still
+  // being written, skipped counts those frames.
+} output_job;
+
 struct editorConfig {
   // This is a structure that contains the editor configuration.
   int cx, cy;
   // cx and cy are the cursor position.
   int rx;
-  // rx is the position of the cursor in the rendered row.
+  // rx is the screen column of the cursor in its row.
   int screenrows;
   int screencols;
   int numrows;
@@ -56,9 +988,122 @@ struct editorConfig {
   int rof;
   int cof;
   // rof and cof are the row and column offset
-  editor_row *row;
-  // row is the row of the file.
+  buf_node *root;
+  // root is the rope holding the rows of the file, see the text buffer
+  // functions for how to reach them.
+  arena mem;
+  // mem is the arena the nodes and row strings of the buffer live in.
+  text_block *text;
+  size_t textbytes;
+  // text is the newest text block, the older ones are linked through prev.
+  // textbytes is what the blocks hold.
+  rx_index *rxidx;
+  int nrxidx;
+  int rxcap;
+  int rxfree;
+  // rxidx holds the column indexes of long rows, rxfree is 1 + the first
+  // unused entry or 0.
+  char *map;
+  size_t maplen;
+  // map is the read only mapping of the opened file that rows point into.
+  load_job load;
+  int loading;
+  // loading is set while the rows of the mapped file are still being indexed
+  // and added to the end of the buffer.
+  paged_file pager;
+  int paged;
+  // paged is set when the file is viewed through pager instead of being
+  // loaded into the buffer. A paged file is read only.
+  file_watch watch;
+  // watch keeps the buffer up to date with the file on disk.
+  stream_job stream;
+  // stream is the pipe rows are read from, with cedit -.
+  find_job find;
+  // find is the search started with Ctrl-F.
+  undo_log undo;
+  // undo is the history Ctrl-Z and Ctrl-Y move through.
+  macro macro;
+  // macro is the keyboard macro Ctrl-K records and Ctrl-G replays.
+  journal journal;
+  // journal keeps the unsaved edits in a swap file.
+  hl_cache hl;
+  // hl is the state of the syntax highlighter.
+  size_t (*findbyte)(const char *s, size_t n, char c);
+  size_t (*countbyte)(const char *s, size_t n, char c);
+  const char *kernelname;
+  // findbyte and countbyte are the scanning kernels picked for this CPU.
   char *filename;
+  long dirty;
+  // dirty counts the edits made since the file was last saved.
+  save_job save;
+  int saving;
+  pthread_t savethread;
+  // saving is set while a background save is running on savethread.
+  uint64_t *frame;
+  // frame holds a hash of every screen line as it was last sent to the
+  // terminal, so lines that did not change are not sent again.
+  int framevalid;
+  // framevalid is 0 when the terminal contents are unknown and every line has
+  // to be drawn.
+  int framerof;
+  int framecof;
+  // framerof and framecof are the offsets the last frame was drawn with.
+  int canscroll;
+  // canscroll is 1 when the terminal understands scroll regions.
+  int framebytes;
+  // framebytes is the number of bytes written for the last frame.
+  unsigned char inring[INPUT_RING_SIZE];
+  unsigned int inhead;
+  unsigned int intail;
+  // inring holds raw input bytes between intail and inhead. Both only ever
+  // grow and are taken modulo INPUT_RING_SIZE when indexing.
+  int keys[KEY_QUEUE_SIZE];
+  int keyhead;
+  int nkeys;
+  // keys is the queue of decoded keys waiting to be processed.
+  int inpaste;
+  // inpaste is 1 between the start and end markers of a bracketed paste.
+  int pastequeued;
+  // pastequeued is 1 while a PASTE_KEY for the paste buffer is in the queue.
+  char *paste;
+  size_t pastelen;
+  size_t pastecap;
+  // paste holds the text of the last bracketed paste.
+  int wakepipe[2];
+  // wakepipe is the self-pipe the SIGWINCH handler and the worker threads
+  // write to, so poll() wakes up for them. Every byte says why: 'w' for a
+  // window size change, 's' for save progress, 'l' for an indexed chunk,
+  // 'i' for progress of the line index of a paged file, 'f' for a searched
+  // unit, 'o' for a frame the output thread has written, 'j' for a write
+  // of the swap file that finished.
+  int headless;
+  int headrows;
+  int headcols;
+  // headless is set when there is no terminal, the screen is headrows by
+  // headcols and the keys come from a script.
+  int infd;
+  int outfd;
+  // infd is where keys are read from and outfd where frames are written.
+  // Without a terminal those are the script, -1 until it is opened, and the
+  // sink.
+  int inputeof;
+  // inputeof is set once the whole script has been read.
+  char *script;
+  long long outbytes;
+  // outbytes counts the bytes written to outfd.
+  double *latency;
+  int nlatency;
+  int latencycap;
+  double opentime;
+  // latency holds the time every replayed key took, opentime how long the
+  // file took to load.
+  editor_stats stats;
+  output_job out;
+  // out writes the frames to the terminal.
+  int redraw;
+  // redraw is set when something other than a key needs a new frame.
+  int clearscreen;
+  // clearscreen is set when the terminal has to be cleared before drawing.
   char statusmsg[80];
   time_t statusmsg_time;
   struct termios orig_termios;
@@ -70,6 +1115,19 @@ struct editorConfig E;
 #define CEDIT_VERSION "0.0.1"
 #define CEDIT_TAB_STOP 4
 #define CTRL_KEY(k) ((k)&0x1f)
+#if CEDIT_STATS
+#define STATS_START(t) double t = editorNow()
+#define STATS_TIME(phase, t) (E.stats.cur.phase += editorNow() - (t))
+#define STATS_COUNT(counter, n) (E.stats.cur.counter += (n))
+#define STATS_FRAME() editorStatsFrame()
+#else
+#define STATS_START(t)
+#define STATS_TIME(phase, t)
+#define STATS_COUNT(counter, n)
+#define STATS_FRAME()
+#endif
+// The STATS macros time a phase of the current frame or bump one of its
+// counters, see frame_stats.
 
 enum editorKey {
   // This is an enumeration that contains the key codes.
@@ -81,14 +1139,95 @@ enum editorKey {
   PAGE_DOWN = 1005,
   HOME_KEY = 1006,
   END_KEY = 1007,
-  DEL_KEY = 1008
+  DEL_KEY = 1008,
+  PASTE_KEY = 1009,
+  // PASTE_KEY means a bracketed paste is waiting in E.paste.
+  PASTE_START = 1010,
+  // PASTE_START is only used while decoding and never reaches the editor.
+  FILE_HOME = 1011,
+  FILE_END = 1012,
+  // FILE_HOME and FILE_END are Ctrl-Home and Ctrl-End.
+  BACKSPACE = 127
 };
 // This macro will return the ASCII value of the control key pressed.
 
+/* filetypes */
+char *C_HL_extensions[] = {".c", ".h", ".cc", ".cpp", ".cxx", ".hh", ".hpp",
+                           NULL};
+char *C_HL_keywords[] = {
+    "switch", "if",     "while",   "for",     "break",   "continue",
+    "return", "else",   "struct",  "union",   "typedef", "static",
+    "enum",   "class",  "case",    "default", "goto",    "do",
+    "sizeof", "extern", "const",   "volatile", "inline", "register",
+    "int|",   "long|",  "double|", "float|",  "char|",   "unsigned|",
+    "signed|", "void|", "short|",  "size_t|", "bool|",   NULL};
+char *SH_HL_extensions[] = {".sh", ".bash", ".zsh", ".bashrc", ".profile",
+                            NULL};
+char *SH_HL_keywords[] = {
+    "if",   "then",   "else",   "elif",   "fi",     "for",   "while",
+    "until", "do",    "done",   "case",   "esac",   "in",    "function",
+    "return", "exit", "local|", "export|", "readonly|", "set|", "echo|",
+    "cd|",  "source|", NULL};
+char *LOG_HL_extensions[] = {".log", ".out", "syslog", "messages", NULL};
+
+editor_syntax HLDB[] = {
+    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/",
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_PREPROC},
+    {"sh", SH_HL_extensions, SH_HL_keywords, "#", NULL, NULL,
+     HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_SHELL},
+    {"log", LOG_HL_extensions, NULL, NULL, NULL, NULL, HL_LOG},
+};
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+// HLDB is the highlight database, editorSelectSyntax() picks an entry.
+
+/* prototypes */
+void editorSetStatusMessage(const char *fmt, ...);
+void editorRefreshScreen();
+char *editorPrompt(char *prompt, void (*callback)(char *, int),
+                   int allowempty);
+void editorWaitEvent();
+void editorReplayFinish();
+void undoBegin();
+void undoRecord(int type, int row, int col, const char *s, size_t len);
+int undoTyped(int row, int col, char ch);
+void journalRecord(int type, int row, int col, const char *s, size_t len);
+void journalTyped(int row, int col, char ch);
+editor_row *editorPagedRow(int at);
+void editorHlShift(int at, int delta);
+void editorHlChanged(int at);
+void editorWatchStart(off_t size);
+void editorWatchFollow();
+void editorOutputFlush();
+void editorProcessKey(int c);
+void abAppend(struct abuf *ab, const char *s, int len);
+
 /* terminal */
+void editorWriteAll(const char *s, size_t len) {
+  // This function will send len bytes of s to the terminal, or to the sink
+  // of a headless run.
+  while (len > 0) {
+    ssize_t n = write(E.outfd, s, len);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    E.outbytes += n;
+    s += n;
+    len -= n;
+  }
+}
+
+void editorWrite(const char *s, size_t len) {
+  // This function will send len bytes of s to the terminal right away,
+  // after the frame the output thread may still be writing.
+  editorOutputFlush();
+  editorWriteAll(s, len);
+}
+
 void die(const char *s) {
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  write(STDOUT_FILENO, "\x1b[H", 3);
+  editorWrite("\x1b[2J", 4);
+  editorWrite("\x1b[H", 3);
   // Clear the screen and move the cursor to the top left corner before exiting
 
   perror(s);
@@ -98,6 +1237,8 @@ void die(const char *s) {
 
 void disableRawMode() {
   // This function will restore the original terminal attributes.
+  editorWrite("\x1b[?2004l", 8);
+  // turn bracketed paste off again.
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -130,9 +1271,10 @@ void enableRawMode() {
   // input. ISIG  stops the terminal from sending signals like ctrl-c and
   // ctrl-z. IEXTEN  stops the terminal from sending ctrl-v.
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
   // VMIN sets the minimum number of bytes of input needed for read to return
-  // VTIME sets the maximum amount of time to wait before read returns.
+  // VTIME sets the maximum amount of time to wait before read returns. Both
+  // are 0 so read never blocks, the waiting is done by poll().
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw))
     die("tcsetattr");
@@ -141,84 +1283,242 @@ void enableRawMode() {
   // TCSAFLUSH means that the change will occur after all output written to the
   // terminal has been transmitted, and all input that has been received but not
   // read will be discarded before the change is made.
+  editorWrite("\x1b[?2004h", 8);
+  // ask the terminal to wrap pasted text in \x1b[200~ and \x1b[201~ so a
+  // paste can be inserted as one block instead of key by key.
 }
 
-int editorReadKey() {
-  // This function will read a key from the terminal and return it.
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
-      die("read");
+/* input decoding */
+int editorFillInput() {
+  // This function will read as much input as there is room for in the ring
+  // buffer with a single read() and return the number of bytes read.
+  unsigned int room = INPUT_RING_SIZE - (E.inhead - E.intail);
+  unsigned int start = E.inhead % INPUT_RING_SIZE;
+  unsigned int chunk = INPUT_RING_SIZE - start;
+  // chunk is the free space up to the end of the ring.
+  if (chunk > room)
+    chunk = room;
+  if (chunk == 0)
+    return 0;
+
+  int nread = read(E.infd, &E.inring[start], chunk);
+  if (nread == -1 && errno != EAGAIN)
+    die("read");
+  if (nread == 0 && E.headless) {
+    // the end of the script. A terminal with nothing to read returns 0 too,
+    // so this only counts without one.
+    close(E.infd);
+    E.infd = -1;
+    E.inputeof = 1;
   }
+  if (nread <= 0)
+    return 0;
+  E.inhead += nread;
+  return nread;
+}
 
-  if (c == '\x1b') {
-    // If the key pressed is escape then read the next two bytes and return
-    // escape sequence if it is an escape sequence.
-    // If arrow keys are pressed return corresponding sequence.
-    char seq[3];
-    if (read(STDIN_FILENO, &seq[0], 1) != 1)
-      return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1)
-      return '\x1b';
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1)
-          return '\x1b';
-
-        if (seq[2] == '~') {
-          // If the third byte is ~ then return the corresponding sequence.
-          switch (seq[1]) {
-          case '1':
-            return HOME_KEY;
-          case '3':
-            return DEL_KEY;
-          case '4':
-            return END_KEY;
-          case '5':
-            return PAGE_UP;
-          case '6':
-            return PAGE_DOWN;
-          case '7':
-            return HOME_KEY;
-          case '8':
-            return END_KEY;
-          }
-        }
-      } else {
-        switch (seq[1]) {
-        //
-        case 'A':
-          return ARROW_UP;
-        case 'B':
-          return ARROW_DOWN;
-        case 'C':
-          return ARROW_RIGHT;
-        case 'D':
-          return ARROW_LEFT;
-        case 'H':
-          return HOME_KEY;
-        case 'F':
-          return END_KEY;
-        }
+int editorPeekInput(unsigned int i) {
+  // This function will return the i-th unread input byte, or -1 if it has not
+  // arrived yet.
+  if (E.inhead - E.intail <= i)
+    return -1;
+  return E.inring[(E.intail + i) % INPUT_RING_SIZE];
+}
+
+void editorQueueKey(int key) {
+  // This function will add a decoded key to the end of the key queue.
+  E.keys[(E.keyhead + E.nkeys) % KEY_QUEUE_SIZE] = key;
+  E.nkeys++;
+}
+
+int editorDecodeEscape(int *key) {
+  // This function will decode the escape sequence at the start of the unread
+  // input into key. It returns the number of bytes the sequence used, or 0
+  // when the sequence is not complete yet.
+  int c = editorPeekInput(1);
+  if (c == -1)
+    return 0;
+
+  if (c == '[') {
+    // control sequence: \x1b[ followed by parameters and a final byte.
+    int num = 0;
+    int mod = 0;
+    int more = 0;
+    // num is the first parameter and mod the second, which says what
+    // modifier keys were held. more counts the ; seen so far.
+    int i = 2;
+    while ((c = editorPeekInput(i)) != -1 && (isdigit(c) || c == ';')) {
+      if (i < 16) {
+        if (c == ';')
+          more++;
+        else if (!more)
+          num = num * 10 + (c - '0');
+        else if (more == 1)
+          mod = mod * 10 + (c - '0');
+      }
+      i++;
+    }
+    if (c == -1)
+      return 0;
+
+    *key = '\x1b';
+    if (i > 16)
+      // nothing we understand is this long, the whole sequence up to its
+      // final byte counts as a lone escape.
+      return i + 1;
+    if (c == '~') {
+      // If the final byte is ~ then return the corresponding sequence.
+      switch (num) {
+      case 1:
+      case 7:
+        *key = HOME_KEY;
+        break;
+      case 3:
+        *key = DEL_KEY;
+        break;
+      case 4:
+      case 8:
+        *key = END_KEY;
+        break;
+      case 5:
+        *key = PAGE_UP;
+        break;
+      case 6:
+        *key = PAGE_DOWN;
+        break;
+      case 200:
+        *key = PASTE_START;
+        break;
       }
-    } else if (seq[0] == 'O') {
-      switch (seq[1]) {
+    } else {
+      switch (c) {
+      case 'A':
+        *key = ARROW_UP;
+        break;
+      case 'B':
+        *key = ARROW_DOWN;
+        break;
+      case 'C':
+        *key = ARROW_RIGHT;
+        break;
+      case 'D':
+        *key = ARROW_LEFT;
+        break;
       case 'H':
-        return HOME_KEY;
+        *key = mod == 5 ? FILE_HOME : HOME_KEY;
+        break;
       case 'F':
-        return END_KEY;
+        *key = mod == 5 ? FILE_END : END_KEY;
+        break;
+        // modifier 5 is the control key.
       }
     }
+    return i + 1;
+  } else if (c == 'O') {
+    int c2 = editorPeekInput(2);
+    if (c2 == -1)
+      return 0;
+    *key = c2 == 'H' ? HOME_KEY : c2 == 'F' ? END_KEY : '\x1b';
+    return 3;
+  }
 
-    return '\x1b';
-  } else {
-    return c;
+  *key = '\x1b';
+  return 1;
+}
+
+int editorDecodePaste() {
+  // This function will move bracketed paste bytes from the ring buffer to the
+  // paste buffer until the end marker. It returns 0 when it ran out of input
+  // in the middle of the paste.
+  static const char end[] = "\x1b[201~";
+  while (E.inhead != E.intail) {
+    int c = editorPeekInput(0);
+    if (c == '\x1b') {
+      int j;
+      for (j = 1; j < 6; j++) {
+        int d = editorPeekInput(j);
+        if (d == -1)
+          return 0;
+        // wait for the rest of what may be the end marker.
+        if (d != end[j])
+          break;
+      }
+      if (j == 6) {
+        // the end marker, hand the whole paste over as one key.
+        E.intail += 6;
+        E.inpaste = 0;
+        E.pastequeued = 1;
+        editorQueueKey(PASTE_KEY);
+        return 1;
+      }
+    }
+    if (E.pastelen == E.pastecap) {
+      E.pastecap = E.pastecap ? E.pastecap * 2 : 4096;
+      E.paste = realloc(E.paste, E.pastecap);
+      if (E.paste == NULL)
+        die("realloc");
+    }
+    E.paste[E.pastelen++] = c;
+    E.intail++;
+  }
+  return 0;
+}
+
+void editorDecodeInput(int flush) {
+  // This function will decode as much of the unread input as possible into the
+  // key queue. An escape sequence that is cut short is left for the next read
+  // unless flush is set, then it counts as a lone escape key.
+  while (E.inhead != E.intail && E.nkeys < KEY_QUEUE_SIZE && !E.pastequeued) {
+    if (E.inpaste) {
+      if (!editorDecodePaste())
+        return;
+      continue;
+    }
+
+    int key = editorPeekInput(0);
+    int used = 1;
+    if (key == '\x1b') {
+      used = editorDecodeEscape(&key);
+      if (used == 0) {
+        if (!flush)
+          return;
+        key = '\x1b';
+        used = 1;
+      }
+    }
+    E.intail += used;
+
+    if (key == PASTE_START) {
+      E.inpaste = 1;
+      E.pastelen = 0;
+      continue;
+    }
+    editorQueueKey(key);
   }
 }
 
+int editorReadKey() {
+  // This function will return the next key, waiting for more input when the
+  // queue is empty.
+  while (E.nkeys == 0)
+    editorWaitEvent();
+
+  int key = E.keys[E.keyhead];
+  E.keyhead = (E.keyhead + 1) % KEY_QUEUE_SIZE;
+  E.nkeys--;
+  if (key == PASTE_KEY)
+    E.pastequeued = 0;
+  // the paste buffer may be refilled once the caller has inserted it.
+  return key;
+}
+
 int getWindowSize(int *rows, int *cols) {
   // This function will get the size of the terminal window.
+  if (E.headless) {
+    *rows = E.headrows;
+    *cols = E.headcols;
+    return 0;
+  }
   struct winsize ws;
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
     // on sucess ioctl() returns 0 and put the size of the terminal in ws.
@@ -230,172 +1530,5242 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
-/* row functions */
-int editorRowCxtoRx(editor_row *row, int cx) {
-  // creates character index to render index mapping.
-  int rx = 0;
-  int j;
-  for (j = 0; j < cx; j++) {
-    // if the character is a tab then add 8 - (rx % 8) to rx.
-    // else add 1 to rx.
-    if (row->chars[j] == '\t')
-      rx += (CEDIT_TAB_STOP - 1) - (rx % CEDIT_TAB_STOP);
-    rx++;
+/* simd kernels */
+// The loops that look at every byte of a file or a row come in a scalar, an
+// SSE2 and an AVX2 version. editorInitKernels() picks the best one the CPU
+// supports and stores it in E.findbyte and E.countbyte.
+
+size_t kernelFindByteScalar(const char *s, size_t n, char c) {
+  // This function will return the index of the first c in s, or n if there
+  // is none. It looks at eight bytes at a time (SWAR).
+  const uint64_t ones = 0x0101010101010101ULL;
+  const uint64_t highs = 0x8080808080808080ULL;
+  uint64_t pattern = ones * (unsigned char)c;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    memcpy(&word, s + i, 8);
+    word ^= pattern;
+    // a byte equal to c is now zero.
+    if ((word - ones) & ~word & highs)
+      break;
   }
-  return rx;
+  for (; i < n; i++)
+    if (s[i] == c)
+      return i;
+  return n;
+}
+
+size_t kernelCountByteScalar(const char *s, size_t n, char c) {
+  // This function will return how many times c occurs in s.
+  size_t count = 0;
+  size_t i;
+  for (i = 0; i < n; i++)
+    count += s[i] == c;
+  return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) size_t kernelFindByteSse2(const char *s,
+                                                         size_t n, char c) {
+  // This function will do what kernelFindByteScalar() does 16 bytes at a time.
+  __m128i needle = _mm_set1_epi8(c);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + kernelFindByteScalar(s + i, n - i, c);
+  // the last few bytes go through the scalar version.
+}
+
+__attribute__((target("sse2"))) size_t kernelCountByteSse2(const char *s,
+                                                          size_t n, char c) {
+  // This function will do what kernelCountByteScalar() does 16 bytes at a
+  // time. Matches are summed in 8 bit lanes for up to 255 blocks and then
+  // folded into the total with a sum of absolute differences.
+  __m128i needle = _mm_set1_epi8(c);
+  __m128i zero = _mm_setzero_si128();
+  size_t count = 0;
+  size_t i = 0;
+  while (i + 16 <= n) {
+    __m128i acc = _mm_setzero_si128();
+    int blocks = 0;
+    for (; i + 16 <= n && blocks < 255; i += 16, blocks++) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, needle));
+      // a match is -1, subtracting it adds one to the lane.
+    }
+    __m128i sums = _mm_sad_epu8(acc, zero);
+    count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
+  }
+  return count + kernelCountByteScalar(s + i, n - i, c);
+}
+
+__attribute__((target("avx2"))) size_t kernelFindByteAvx2(const char *s,
+                                                         size_t n, char c) {
+  // This function will do what kernelFindByteScalar() does 32 bytes at a time.
+  __m256i needle = _mm256_set1_epi8(c);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  _mm256_zeroupper();
+  // clear the upper halves of the registers, or the SSE2 code below pays a
+  // large penalty for switching between AVX and SSE instructions.
+  return i + kernelFindByteSse2(s + i, n - i, c);
+  // what is left is less than 32 bytes, short rows end up here, so the SSE2
+  // version takes the next 16 bytes before falling back to scalar.
+}
+
+__attribute__((target("avx2"))) size_t kernelCountByteAvx2(const char *s,
+                                                          size_t n, char c) {
+  // This function will do what kernelCountByteSse2() does 32 bytes at a time.
+  __m256i needle = _mm256_set1_epi8(c);
+  __m256i zero = _mm256_setzero_si256();
+  size_t count = 0;
+  size_t i = 0;
+  while (i + 32 <= n) {
+    __m256i acc = _mm256_setzero_si256();
+    int blocks = 0;
+    for (; i + 32 <= n && blocks < 255; i += 32, blocks++) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, needle));
+    }
+    __m256i sums = _mm256_sad_epu8(acc, zero);
+    count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+             _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+  }
+  _mm256_zeroupper();
+  return count + kernelCountByteSse2(s + i, n - i, c);
 }
+#endif
 
-void editorUpdateRow(editor_row *row) {
-  // This function will update the row by calculating the number of tabs and
-  // non-tab characters in the row.
-  int tabs = 0;
-  int j = 0;
+void editorInitKernels() {
+  // This function will pick the fastest kernels the CPU supports. Setting
+  // CEDIT_KERNELS to scalar, sse2 or avx2 forces a particular version.
+  const char *force = getenv("CEDIT_KERNELS");
+  E.findbyte = kernelFindByteScalar;
+  E.countbyte = kernelCountByteScalar;
+  E.kernelname = "scalar";
+  if (force && strcmp(force, "scalar") == 0)
+    return;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    E.findbyte = kernelFindByteSse2;
+    E.countbyte = kernelCountByteSse2;
+    E.kernelname = "sse2";
+  }
+  if (force && strcmp(force, "sse2") == 0)
+    return;
+  if (__builtin_cpu_supports("avx2")) {
+    E.findbyte = kernelFindByteAvx2;
+    E.countbyte = kernelCountByteAvx2;
+    E.kernelname = "avx2";
+  }
+#endif
+}
+
+/* kernel benchmark */
+size_t benchLoopLines(const char *s, size_t n) {
+  // This function will split the text into lines looking at one byte at a
+  // time, the baseline.
+  size_t lines = 0;
+  size_t i = 0;
+  while (i < n) {
+    size_t j = i;
+    while (j < n && s[j] != '\n')
+      j++;
+    if (j < n)
+      lines++;
+    i = j + 1;
+  }
+  return lines;
+}
 
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t')
+size_t benchLoopTabs(const char *s, size_t n) {
+  // This function will count the tabs of a row one byte at a time, the
+  // baseline.
+  size_t tabs = 0;
+  size_t j;
+  for (j = 0; j < n; j++)
+    if (s[j] == '\t')
       tabs++;
+  return tabs;
+}
+
+int editorBenchKernels(size_t mb) {
+  // This function will time the line splitting and tab counting kernels
+  // against the byte loops they replace on mb megabytes of
+  // generated text that looks like source code: lines of 0 to 120 bytes with
+  // a leading tab on every fourth line. It prints one line per kernel.
+  size_t n = mb * 1024 * 1024;
+  char *text = malloc(n);
+  if (text == NULL) {
+    fprintf(stderr, "cannot allocate %zu MB\n", mb);
+    return 1;
+  }
+  size_t i = 0;
+  unsigned int seed = 1;
+  while (i < n) {
+    seed = seed * 1103515245 + 12345;
+    size_t len = (seed >> 16) % 121;
+    size_t j;
+    for (j = 0; j < len && i < n; j++, i++)
+      text[i] = (j == 0 && (seed & 0x300) == 0) ? '\t' : 'a' + (j + i) % 26;
+    if (i < n)
+      text[i++] = '\n';
+  }
+
+  struct {
+    const char *name;
+    size_t (*findbyte)(const char *, size_t, char);
+    size_t (*countbyte)(const char *, size_t, char);
+  } impls[4];
+  int nimpls = 0;
+  editorInitKernels();
+  const char *best = E.kernelname;
+  impls[nimpls].name = "scalar";
+  impls[nimpls].findbyte = kernelFindByteScalar;
+  impls[nimpls++].countbyte = kernelCountByteScalar;
+#if defined(__x86_64__) || defined(__i386__)
+  impls[nimpls].name = "sse2";
+  impls[nimpls].findbyte = kernelFindByteSse2;
+  impls[nimpls++].countbyte = kernelCountByteSse2;
+  if (strcmp(best, "avx2") == 0) {
+    impls[nimpls].name = "avx2";
+    impls[nimpls].findbyte = kernelFindByteAvx2;
+    impls[nimpls++].countbyte = kernelCountByteAvx2;
+  }
+#endif
+
+  printf("%zu MB of text, runtime dispatch picks %s\n", mb, best);
+  printf("%-10s %-8s %10s %12s\n", "kernel", "impl", "GB/s", "checksum");
+
+  double t = editorNow();
+  size_t sum = benchLoopLines(text, n);
+  double secs = editorNow() - t;
+  printf("%-10s %-8s %10.2f %12zu\n", "newline", "loop", n / secs / 1e9, sum);
+  int k;
+  for (k = 0; k < nimpls; k++) {
+    // split the text into lines the way editorOpen() does.
+    t = editorNow();
+    sum = 0;
+    for (i = 0; i < n; i++) {
+      i += impls[k].findbyte(text + i, n - i, '\n');
+      if (i < n)
+        sum++;
+    }
+    secs = editorNow() - t;
+    printf("%-10s %-8s %10.2f %12zu\n", "newline", impls[k].name,
+           n / secs / 1e9, sum);
+  }
+
+  t = editorNow();
+  sum = 0;
+  for (i = 0; i < n;) {
+    size_t len = kernelFindByteScalar(text + i, n - i, '\n');
+    sum += benchLoopTabs(text + i, len);
+    i += len + 1;
+  }
+  secs = editorNow() - t;
+  printf("%-10s %-8s %10.2f %12zu\n", "tabcount", "loop", n / secs / 1e9, sum);
+  for (k = 0; k < nimpls; k++) {
+    t = editorNow();
+    sum = 0;
+    for (i = 0; i < n;) {
+      size_t len = kernelFindByteScalar(text + i, n - i, '\n');
+      sum += impls[k].countbyte(text + i, len, '\t');
+      i += len + 1;
+    }
+    secs = editorNow() - t;
+    printf("%-10s %-8s %10.2f %12zu\n", "tabcount", impls[k].name,
+           n / secs / 1e9, sum);
+  }
+
+  free(text);
+  return 0;
+}
+
+/* arena */
+int arenaClass(size_t n) {
+  // This function will return the smallest size class that fits n bytes.
+  int cls = 0;
+  while (((size_t)ARENA_MIN_BLOCK << cls) < n)
+    cls++;
+  return cls;
+}
+
+size_t arenaClassSize(int cls) {
+  // This function will return the size of the blocks of a size class.
+  return (size_t)ARENA_MIN_BLOCK << cls;
+}
+
+arena_chunk *arenaNewChunk(arena *a, size_t size) {
+  // This function will get a new chunk of size bytes from the system and
+  // link it into the chunk list of the arena.
+  arena_chunk *chunk = malloc(sizeof(arena_chunk) + size);
+  if (chunk == NULL)
+    die("malloc");
+  chunk->size = size;
+  chunk->prev = NULL;
+  chunk->next = a->chunks;
+  if (a->chunks)
+    a->chunks->prev = chunk;
+  a->chunks = chunk;
+  a->mallocs++;
+  a->bytes += size;
+  return chunk;
+}
+
+void *arenaAlloc(arena *a, int cls) {
+  // This function will return a block of size class cls.
+  size_t size = arenaClassSize(cls);
+  a->blocks++;
+  STATS_COUNT(allocs, 1);
+
+  if (a->freelist[cls]) {
+    // reuse a block that was released earlier.
+    void *block = a->freelist[cls];
+    a->freelist[cls] = *(void **)block;
+    return block;
+  }
+
+  if (size > ARENA_BIG_BLOCK)
+    return arenaNewChunk(a, size) + 1;
+  // the block is the memory right after the chunk header.
+
+  if (a->left < size) {
+    // the newest chunk is full. Its tail goes on the free lists so nothing is
+    // wasted, then a new chunk twice as large as the last one is started.
+    while (a->left >= ARENA_MIN_BLOCK) {
+      int tail = arenaClass(a->left);
+      if (arenaClassSize(tail) > a->left)
+        tail--;
+      *(void **)a->cur = a->freelist[tail];
+      a->freelist[tail] = a->cur;
+      a->cur += arenaClassSize(tail);
+      a->left -= arenaClassSize(tail);
+    }
+    if (a->chunksize == 0)
+      a->chunksize = ARENA_FIRST_CHUNK;
+    else if (a->chunksize < ARENA_MAX_CHUNK)
+      a->chunksize *= 2;
+    a->cur = (char *)(arenaNewChunk(a, a->chunksize) + 1);
+    a->left = a->chunksize;
+  }
+
+  void *block = a->cur;
+  a->cur += size;
+  a->left -= size;
+  return block;
+}
+
+void arenaRelease(arena *a, void *block, int cls) {
+  // This function will give a block of size class cls back to the arena.
+  if (block == NULL)
+    return;
+  a->blocks--;
+  if (arenaClassSize(cls) > ARENA_BIG_BLOCK) {
+    // big blocks have their own chunk which goes straight back to the system.
+    arena_chunk *chunk = (arena_chunk *)block - 1;
+    if (chunk->prev)
+      chunk->prev->next = chunk->next;
+    else
+      a->chunks = chunk->next;
+    if (chunk->next)
+      chunk->next->prev = chunk->prev;
+    a->bytes -= chunk->size;
+    free(chunk);
+    return;
+  }
+  *(void **)block = a->freelist[cls];
+  a->freelist[cls] = block;
+}
+
+void arenaFreeAll(arena *a) {
+  // This function will give every chunk of the arena back to the system.
+  arena_chunk *chunk = a->chunks;
+  while (chunk) {
+    arena_chunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  memset(a, 0, sizeof(arena));
+}
+
+/* text blocks */
+// Rows made in bulk, by a paste, a replayed swap file or a file read line by
+// line, are copied into shared text blocks instead of getting an arena block
+// each. Such a row costs its length and a line break instead of a power of
+// two, and it stays a view: the first edit copies it like a row of the
+// mapped file. Blocks are aligned to their size, so the block of a row is
+// found from its pointer alone.
+
+text_block *textBlockOf(const char *s) {
+  // This function will return the text block s points into.
+  return (text_block *)((uintptr_t)s & ~(uintptr_t)(TEXT_BLOCK_BYTES - 1));
+}
+
+char *textStore(const char *s, size_t len) {
+  // This function will copy len bytes of s and a line break into the newest
+  // text block, starting a new one when it is full, and return the copy.
+  // len must be at most TEXT_ROW_MAX.
+  text_block *b = E.text;
+  if (b == NULL || TEXT_BLOCK_BYTES - b->used < len + 1) {
+    void *mem;
+    if (posix_memalign(&mem, TEXT_BLOCK_BYTES, TEXT_BLOCK_BYTES) != 0)
+      die("posix_memalign");
+    b = mem;
+    b->prev = E.text;
+    b->next = NULL;
+    if (E.text)
+      E.text->next = b;
+    b->used = sizeof(text_block);
+    b->live = 0;
+    E.text = b;
+    E.textbytes += TEXT_BLOCK_BYTES;
+  }
+  char *chars = (char *)b + b->used;
+  memcpy(chars, s, len);
+  chars[len] = '\n';
+  b->used += len + 1;
+  b->live++;
+  return chars;
+}
+
+void textFreeBlock(text_block *b) {
+  // This function will give a text block back to the system.
+  if (b->prev)
+    b->prev->next = b->next;
+  if (b->next)
+    b->next->prev = b->prev;
+  if (E.text == b)
+    E.text = b->prev;
+  E.textbytes -= TEXT_BLOCK_BYTES;
+  free(b);
+}
+
+void textRelease(const char *s) {
+  // This function will note that a row no longer looks at s. A block without
+  // rows goes at once, unless it is still being filled or a background save
+  // reads from it, then textSweep() frees it later.
+  text_block *b = textBlockOf(s);
+  if (--b->live == 0 && b != E.text && !E.saving)
+    textFreeBlock(b);
+}
+
+void textSweep() {
+  // This function will free the blocks that lost their last row while a save
+  // was running.
+  text_block *b = E.text ? E.text->prev : NULL;
+  while (b) {
+    text_block *prev = b->prev;
+    if (b->live == 0)
+      textFreeBlock(b);
+    b = prev;
+  }
+}
+
+void textFreeAll() {
+  // This function will free every text block.
+  while (E.text)
+    textFreeBlock(E.text);
+}
+
+/* text buffer */
+// The functions below are the only ones that know how the rows are stored.
+// Everything else asks for rows by index. Pointers returned by bufRow() stay
+// valid until the next row is inserted or deleted.
+
+int bufCount(buf_node *node) {
+  // This function will return the number of rows under a node.
+  return node ? node->count : 0;
+}
+
+void bufUpdate(buf_node *node) {
+  // This function will recompute the row count of a node from its children.
+  node->count = bufCount(node->left) + node->nrows + bufCount(node->right);
+}
+
+buf_node *bufNewNode() {
+  // This function will allocate an empty node with a random priority.
+  buf_node *node = arenaAlloc(&E.mem, arenaClass(sizeof(buf_node)));
+  node->left = NULL;
+  node->right = NULL;
+  node->prio = rand();
+  node->count = 0;
+  node->nrows = 0;
+  return node;
+}
+
+buf_node *bufRotateLeft(buf_node *node) {
+  // This function will lift the right child of node above it.
+  buf_node *r = node->right;
+  node->right = r->left;
+  r->left = node;
+  bufUpdate(node);
+  bufUpdate(r);
+  return r;
+}
+
+buf_node *bufRotateRight(buf_node *node) {
+  // This function will lift the left child of node above it.
+  buf_node *l = node->left;
+  node->left = l->right;
+  l->right = node;
+  bufUpdate(node);
+  bufUpdate(l);
+  return l;
+}
+
+buf_node *bufMerge(buf_node *a, buf_node *b) {
+  // This function will join two trees where every row of a comes before every
+  // row of b.
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+  if (a->prio > b->prio) {
+    a->right = bufMerge(a->right, b);
+    bufUpdate(a);
+    return a;
+  }
+  b->left = bufMerge(a, b->left);
+  bufUpdate(b);
+  return b;
+}
+
+buf_node *bufInsertLeftmost(buf_node *tree, buf_node *node) {
+  // This function will insert node in front of every other node of tree.
+  if (tree == NULL)
+    return node;
+  tree->left = bufInsertLeftmost(tree->left, node);
+  bufUpdate(tree);
+  if (tree->left->prio > tree->prio)
+    tree = bufRotateRight(tree);
+  return tree;
+}
+
+buf_node *bufInsertAt(buf_node *tree, int at, editor_row **slot) {
+  // This function will make room for a row at index at of tree and store a
+  // pointer to the new slot in slot. It returns the new root of tree.
+  if (tree == NULL) {
+    tree = bufNewNode();
+    tree->nrows = 1;
+    tree->count = 1;
+    *slot = &tree->rows[0];
+    return tree;
+  }
+
+  int lc = bufCount(tree->left);
+  if (at < lc) {
+    // the row belongs to the left subtree.
+    tree->left = bufInsertAt(tree->left, at, slot);
+    bufUpdate(tree);
+    if (tree->left->prio > tree->prio)
+      tree = bufRotateRight(tree);
+    return tree;
+  }
+  if (at > lc + tree->nrows) {
+    // the row belongs to the right subtree.
+    tree->right = bufInsertAt(tree->right, at - lc - tree->nrows, slot);
+    bufUpdate(tree);
+    if (tree->right->prio > tree->prio)
+      tree = bufRotateLeft(tree);
+    return tree;
+  }
+
+  int i = at - lc;
+  // i is the position of the new row inside this node.
+  buf_node *target = tree;
+  if (tree->nrows == BUF_LEAF_ROWS) {
+    // the node is full. Appending just starts a new node, anything else splits
+    // the node in two halves.
+    buf_node *next = bufNewNode();
+    if (i < BUF_LEAF_ROWS) {
+      int half = BUF_LEAF_ROWS / 2;
+      memcpy(next->rows, &tree->rows[half],
+             sizeof(editor_row) * (BUF_LEAF_ROWS - half));
+      next->nrows = BUF_LEAF_ROWS - half;
+      tree->nrows = half;
+      if (i > half) {
+        target = next;
+        i -= half;
+      }
+    } else {
+      target = next;
+      i = 0;
+    }
+    memmove(&target->rows[i + 1], &target->rows[i],
+            sizeof(editor_row) * (target->nrows - i));
+    target->nrows++;
+    *slot = &target->rows[i];
+    bufUpdate(next);
+    tree->right = bufInsertLeftmost(tree->right, next);
+    bufUpdate(tree);
+    if (tree->right->prio > tree->prio)
+      tree = bufRotateLeft(tree);
+    return tree;
+  }
+
+  memmove(&tree->rows[i + 1], &tree->rows[i],
+          sizeof(editor_row) * (tree->nrows - i));
+  // memmove() will shift the rest of the block, at most BUF_LEAF_ROWS rows.
+  tree->nrows++;
+  tree->count++;
+  *slot = &tree->rows[i];
+  return tree;
+}
+
+buf_node *bufDeleteAt(buf_node *tree, int at) {
+  // This function will remove the row at index at from tree and return the
+  // new root of tree. The contents of the row must already be freed.
+  int lc = bufCount(tree->left);
+  if (at < lc) {
+    tree->left = bufDeleteAt(tree->left, at);
+  } else if (at >= lc + tree->nrows) {
+    tree->right = bufDeleteAt(tree->right, at - lc - tree->nrows);
+  } else {
+    int i = at - lc;
+    memmove(&tree->rows[i], &tree->rows[i + 1],
+            sizeof(editor_row) * (tree->nrows - i - 1));
+    tree->nrows--;
+    if (tree->nrows == 0) {
+      // the node is empty, join its children in its place.
+      buf_node *rest = bufMerge(tree->left, tree->right);
+      arenaRelease(&E.mem, tree, arenaClass(sizeof(buf_node)));
+      return rest;
+    }
+  }
+  bufUpdate(tree);
+  return tree;
+}
+
+editor_row *bufRow(int at) {
+  // This function will return the row at index at, or NULL if there is none.
+  if (E.paged)
+    // a paged file has no buffer, its rows are read from the file instead.
+    return editorPagedRow(at);
+  buf_node *node = E.root;
+  while (node) {
+    int lc = bufCount(node->left);
+    if (at < lc) {
+      node = node->left;
+    } else if (at < lc + node->nrows) {
+      return &node->rows[at - lc];
+    } else {
+      at -= lc + node->nrows;
+      node = node->right;
+    }
+  }
+  return NULL;
+}
+
+editor_row *bufInsertRow(int at) {
+  // This function will insert an uninitialised row at index at and return it.
+  editor_row *slot = NULL;
+  buf_node *node = E.root;
+
+  if (at == bufCount(E.root)) {
+    // appending is what loading a file does for every row, so when the last
+    // node has room the row is put there directly while walking down the
+    // right edge of the tree instead of going through the recursion.
+    while (node && node->right)
+      node = node->right;
+    if (node && node->nrows < BUF_LEAF_ROWS) {
+      for (buf_node *n = E.root; n != node; n = n->right)
+        n->count++;
+      node->count++;
+      return &node->rows[node->nrows++];
+    }
+  }
+
+  E.root = bufInsertAt(E.root, at, &slot);
+  return slot;
+}
+
+void bufDeleteRow(int at) {
+  // This function will remove the row at index at.
+  E.root = bufDeleteAt(E.root, at);
+}
+
+void bufWalk(buf_node *node, void (*fn)(editor_row *, void *), void *arg) {
+  // This function will call fn on every row under node, in order.
+  while (node) {
+    bufWalk(node->left, fn, arg);
+    int j;
+    for (j = 0; j < node->nrows; j++)
+      fn(&node->rows[j], arg);
+    node = node->right;
+  }
+}
+
+long bufNodes(buf_node *node) {
+  // This function will return the number of nodes under node.
+  long n = 0;
+  while (node) {
+    n += 1 + bufNodes(node->left);
+    node = node->right;
+  }
+  return n;
+}
+
+void bufCollect(buf_node *node, buf_node ***nodes, int *n, int *cap) {
+  // This function will append the nodes under node to the array nodes, in
+  // order. n is the number of nodes in the array and cap its size, the array
+  // grows as needed.
+  while (node) {
+    bufCollect(node->left, nodes, n, cap);
+    if (*n == *cap) {
+      *cap = *cap ? *cap * 2 : 1024;
+      *nodes = realloc(*nodes, sizeof(buf_node *) * *cap);
+      if (*nodes == NULL)
+        die("realloc");
+    }
+    (*nodes)[(*n)++] = node;
+    node = node->right;
+  }
+}
+
+void bufFree() {
+  // This function will free the whole buffer, every node and every row string,
+  // in one go by dropping the arena they were allocated from.
+  arenaFreeAll(&E.mem);
+  textFreeAll();
+  E.root = NULL;
+  E.numrows = 0;
+  int j;
+  for (j = 0; j < E.nrxidx; j++)
+    free(E.rxidx[j].cp);
+  free(E.rxidx);
+  E.rxidx = NULL;
+  E.nrxidx = 0;
+  E.rxcap = 0;
+  E.rxfree = 0;
+  // the column indexes belonged to the rows that are gone.
+}
+
+/* row functions */
+int editorCharDecode(const char *s, int n, int *cp) {
+  // This function will decode the UTF-8 character at the start of s, which
+  // has n bytes, into cp and return its length in bytes. A byte that does
+  // not start a valid sequence counts as a character of its own.
+  unsigned char c = s[0];
+  int len, j;
+  if (c < 0x80) {
+    *cp = c;
+    return 1;
+  }
+  if (c >= 0xc2 && c < 0xe0) {
+    len = 2;
+    *cp = c & 0x1f;
+  } else if (c >= 0xe0 && c < 0xf0) {
+    len = 3;
+    *cp = c & 0x0f;
+  } else if (c >= 0xf0 && c < 0xf5) {
+    len = 4;
+    *cp = c & 0x07;
+  } else {
+    *cp = c;
+    return 1;
+  }
+  if (len > n) {
+    *cp = c;
+    return 1;
+  }
+  for (j = 1; j < len; j++) {
+    if ((s[j] & 0xc0) != 0x80) {
+      *cp = c;
+      return 1;
+    }
+    *cp = (*cp << 6) | (s[j] & 0x3f);
+  }
+  return len;
+}
+
+int editorCharWidth(const char *s, int n, int rx, int *len) {
+  // This function will return how many screen columns the character at the
+  // start of s takes when it is drawn at column rx, and store its length in
+  // bytes in len.
+  unsigned char c = s[0];
+  if (c >= 0x20 && c < 0x7f) {
+    // plain ASCII, by far the most common case.
+    *len = 1;
+    return 1;
+  }
+  if (c == '\t') {
+    *len = 1;
+    return CEDIT_TAB_STOP - rx % CEDIT_TAB_STOP;
+  }
+  int cp;
+  *len = editorCharDecode(s, n, &cp);
+  if (*len == 1)
+    // control characters are drawn as ^X and take two columns, bytes that are
+    // not UTF-8 are drawn as ? and take one.
+    return c < 0x20 || c == 0x7f ? 2 : 1;
+  int w = wcwidth(cp);
+  // wcwidth() gives 2 for wide characters like CJK and 0 for combining
+  // marks.
+  return w >= 0 ? w : 1;
+}
+
+int editorWalkColumns(const char *s, int from, int to, int rx) {
+  // This function will return the column reached by drawing bytes from to to
+  // of s starting at column rx.
+  int len;
+  while (from < to) {
+    rx += editorCharWidth(&s[from], to - from, rx, &len);
+    from += len;
+  }
+  return rx;
+}
+
+rx_index *editorRowRxIndex(editor_row *row) {
+  // This function will return the column index of a row, giving it an empty
+  // one if it has none yet, or NULL when every index rxi can name is taken.
+  if (row->rxi)
+    return &E.rxidx[row->rxi - 1];
+  int i = E.rxfree;
+  if (i) {
+    E.rxfree = E.rxidx[i - 1].next;
+  } else if (E.nrxidx == (1 << RX_INDEX_BITS) - 1) {
+    return NULL;
+  } else {
+    if (E.nrxidx == E.rxcap) {
+      E.rxcap = E.rxcap ? E.rxcap * 2 : 64;
+      E.rxidx = realloc(E.rxidx, sizeof(rx_index) * E.rxcap);
+      if (E.rxidx == NULL)
+        die("realloc");
+    }
+    i = ++E.nrxidx;
+    E.rxidx[i - 1].cp = NULL;
+    E.rxidx[i - 1].cap = 0;
+  }
+  rx_index *ix = &E.rxidx[i - 1];
+  if (ix->cap == 0) {
+    ix->cap = 16;
+    ix->cp = malloc(sizeof(rx_checkpoint) * ix->cap);
+    if (ix->cp == NULL)
+      die("malloc");
+  }
+  ix->cp[0].off = 0;
+  ix->cp[0].rx = 0;
+  ix->valid = 1;
+  row->rxi = i;
+  return ix;
+}
+
+void editorRowRxRelease(editor_row *row) {
+  // This function will give the column index of a row back to the pool. The
+  // checkpoint array is kept for the next row that needs one.
+  if (row->rxi == 0)
+    return;
+  E.rxidx[row->rxi - 1].next = E.rxfree;
+  E.rxfree = row->rxi;
+  row->rxi = 0;
+}
+
+void editorRowRxInvalidate(editor_row *row, int at) {
+  // This function will throw away the checkpoints a change at byte at of the
+  // row made stale. The ones before at stay.
+  if (row->rxi == 0)
+    return;
+  rx_index *ix = &E.rxidx[row->rxi - 1];
+  int keep = at / RX_CHECKPOINT;
+  if (keep < 1)
+    keep = 1;
+  // cp[0] is column 0 at byte 0 and never goes stale.
+  if (ix->valid > keep)
+    ix->valid = keep;
+}
+
+void editorRowRxExtend(editor_row *row, rx_index *ix, int k, int rx) {
+  // This function will build checkpoints until checkpoint k exists, or one
+  // at column rx or beyond does, or the end of the row is reached.
+  rx_checkpoint last = ix->cp[ix->valid - 1];
+  while (ix->valid <= k && last.rx <= rx && last.off < row->size) {
+    int end = ix->valid * RX_CHECKPOINT;
+    int len;
+    if (end > row->size)
+      break;
+    while (last.off < end) {
+      last.rx += editorCharWidth(&row->chars[last.off], row->size - last.off,
+                                 last.rx, &len);
+      last.off += len;
+    }
+    if (ix->valid == ix->cap) {
+      ix->cap *= 2;
+      ix->cp = realloc(ix->cp, sizeof(rx_checkpoint) * ix->cap);
+      if (ix->cp == NULL)
+        die("realloc");
+    }
+    ix->cp[ix->valid++] = last;
+  }
+}
+
+int editorRowCxtoRx(editor_row *row, int cx) {
+  // creates character index to screen column mapping. Long rows start from
+  // the nearest checkpoint of their column index instead of from column 0,
+  // so the cost does not grow with the position of the cursor.
+  rx_index *ix = NULL;
+  if (row->size >= RX_INDEX_MIN)
+    ix = editorRowRxIndex(row);
+  if (ix == NULL)
+    return editorWalkColumns(row->chars, 0, cx, 0);
+  int k = cx / RX_CHECKPOINT;
+  editorRowRxExtend(row, ix, k, INT_MAX);
+  if (k >= ix->valid)
+    k = ix->valid - 1;
+  if (ix->cp[k].off > cx)
+    k--;
+  return editorWalkColumns(row->chars, ix->cp[k].off, cx, ix->cp[k].rx);
+}
+
+int editorRowRxtoCx(editor_row *row, int rx) {
+  // This function will return the index of the character drawn at column rx,
+  // or the size of the row when it ends before that column. The checkpoint
+  // to start from is found by binary search.
+  int off = 0, cur = 0, len;
+  rx_index *ix = NULL;
+  if (row->size >= RX_INDEX_MIN)
+    ix = editorRowRxIndex(row);
+  if (ix) {
+    editorRowRxExtend(row, ix, INT_MAX, rx);
+    int lo = 0, hi = ix->valid - 1;
+    // find the last checkpoint at or before column rx.
+    while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      if (ix->cp[mid].rx <= rx)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    off = ix->cp[lo].off;
+    cur = ix->cp[lo].rx;
+  }
+  while (off < row->size) {
+    int w = editorCharWidth(&row->chars[off], row->size - off, cur, &len);
+    if (cur + w > rx)
+      break;
+    cur += w;
+    off += len;
+  }
+  return off;
+}
+
+int editorRowNextCx(editor_row *row, int cx) {
+  // This function will return the index of the character after the one at
+  // cx.
+  int cp;
+  if (cx >= row->size)
+    return row->size;
+  return cx + editorCharDecode(&row->chars[cx], row->size - cx, &cp);
+}
+
+int editorRowPrevCx(editor_row *row, int cx) {
+  // This function will return the index of the character before cx.
+  int start = cx - 1;
+  while (start > 0 && start > cx - 4 && (row->chars[start] & 0xc0) == 0x80)
+    start--;
+  // step back over the continuation bytes to the first byte of a character.
+  if (start < 0)
+    return 0;
+  int cp;
+  if (start + editorCharDecode(&row->chars[start], cx - start, &cp) == cx)
+    return start;
+  return cx - 1;
+  // not a valid character, step back a single byte.
+}
+
+editor_row *editorInsertRowView(int at, char *s, size_t len) {
+  // This function will insert a row at index at that points straight at s
+  // without copying it.
+  if (at < 0 || at > E.numrows)
+    return NULL;
+
+  editor_row *row = bufInsertRow(at);
+  // bufInsertRow() will make room for the row in the text buffer.
+  row->size = len;
+  row->chars = s;
+  row->owned = 0;
+  row->pinned = 0;
+  row->shared = 0;
+  // the row is only a view, s must stay valid for as long as the row does.
+  row->rxi = 0;
+  row->hlstate = HL_STATE_UNKNOWN;
+  editorHlShift(at, 1);
+
+  E.numrows++;
+  // Increment the number of rows.
+  return row;
+}
+
+void editorReleaseView(editor_row *row) {
+  // This function will let go of the text block a row is a view into, if it
+  // is one.
+  if (row->shared)
+    textRelease(row->chars);
+  row->shared = 0;
+}
+
+void editorReleaseChars(editor_row *row) {
+  // This function will give the block holding the characters of an owned row
+  // back to the arena. If a background save is still reading the block, it
+  // is only released once the save has finished.
+  if (!row->pinned) {
+    arenaRelease(&E.mem, row->chars, row->cls);
+    return;
+  }
+  save_job *job = &E.save;
+  if (job->ndeferred == job->deferredcap) {
+    job->deferredcap = job->deferredcap ? job->deferredcap * 2 : 64;
+    job->deferred = realloc(job->deferred, sizeof(void *) * job->deferredcap);
+    job->deferredcls = realloc(job->deferredcls, sizeof(int) * job->deferredcap);
+    if (job->deferred == NULL || job->deferredcls == NULL)
+      die("realloc");
+  }
+  job->deferred[job->ndeferred] = row->chars;
+  job->deferredcls[job->ndeferred] = row->cls;
+  job->ndeferred++;
+}
+
+void editorRowReserve(editor_row *row, size_t need) {
+  // This function will make sure the row owns a block that can hold need
+  // bytes. Blocks are a power of two in size, so a row that keeps growing is
+  // only copied each time it doubles.
+  // A row pinned by a running save is always copied, the save still reads the
+  // old block.
+  if (row->owned && !row->pinned && arenaClassSize(row->cls) >= need)
+    return;
+  int cls = arenaClass(need);
+  char *chars = arenaAlloc(&E.mem, cls);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  if (row->owned)
+    editorReleaseChars(row);
+  else
+    editorReleaseView(row);
+  row->chars = chars;
+  row->cls = cls;
+  row->owned = 1;
+  row->pinned = 0;
+}
+
+void editorRowSetChars(editor_row *row, const char *s, size_t len) {
+  // This function will replace the characters of a row with len bytes of s,
+  // in one copy.
+  int cls = arenaClass(len + 1);
+  char *chars = arenaAlloc(&E.mem, cls);
+  memcpy(chars, s, len);
+  chars[len] = '\0';
+  if (row->owned)
+    editorReleaseChars(row);
+  else
+    editorReleaseView(row);
+  row->chars = chars;
+  row->cls = cls;
+  row->owned = 1;
+  row->pinned = 0;
+  row->size = len;
+  editorRowRxInvalidate(row, 0);
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+  // This function will insert a copy of s as a new row at index at.
+  editor_row *row = editorInsertRowView(at, s, len);
+  if (row == NULL)
+    return;
+  editorRowReserve(row, len + 1);
+  // editorRowReserve() will copy the string into a block of the arena,
+  // leaving room for the null character.
+}
+
+editor_row *editorInsertRowShared(int at, const char *s, size_t len) {
+  // This function will insert a copy of s as a new row at index at, stored in
+  // a text block. Rows too long for one get an arena block.
+  if (at < 0 || at > E.numrows)
+    return NULL;
+  if (len > TEXT_ROW_MAX) {
+    editor_row *row = editorInsertRowView(at, (char *)s, len);
+    editorRowReserve(row, len + 1);
+    return row;
+  }
+  editor_row *row = editorInsertRowView(at, textStore(s, len), len);
+  row->shared = 1;
+  return row;
+}
+
+void editorFreeRow(editor_row *row) {
+  // This function will give the memory owned by a row back to the arena, or
+  // to its text block.
+  if (row->owned)
+    editorReleaseChars(row);
+  else
+    editorReleaseView(row);
+  editorRowRxRelease(row);
+}
+
+void editorDelRow(int at) {
+  // This function will delete the row at index at.
+  if (at < 0 || at >= E.numrows)
+    return;
+  editorFreeRow(bufRow(at));
+  bufDeleteRow(at);
+  E.numrows--;
+  editorHlShift(at, -1);
+}
+
+void editorRowOwn(editor_row *row) {
+  // This function will give a row its own copy of its characters. Rows that
+  // still point into the mapped file are copied the first time they are
+  // edited (copy-on-write), rows that are already owned are left alone.
+  editorRowReserve(row, row->size + 1);
+}
+
+void editorRowInsertChar(editor_row *row, int at, int c) {
+  // This function will insert a character at a given position in the row.
+  if (at < 0 || at > row->size)
+    // If the position is less than 0 or greater than the size of the row
+    // then set the position to the size of the row.
+    at = row->size;
+
+  editorRowReserve(row, row->size + 2);
+  // size is plus 2 because we are adding a character and a null character.
+  // The mapped file is read only so a view is copied before editing.
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  // memmove() will move the characters after the position at by one position
+  // to the right.
+  row->size++;
+  row->chars[at] = c;
+  editorRowRxInvalidate(row, at);
+}
+
+void editorRowInsertString(editor_row *row, int at, const char *s,
+                           size_t len) {
+  // This function will insert len bytes of s at a given position in the row.
+  if (at < 0 || at > row->size)
+    at = row->size;
+  editorRowReserve(row, row->size + len + 1);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
+  row->size += len;
+  editorRowRxInvalidate(row, at);
+}
+
+void editorRowAppendString(editor_row *row, char *s, size_t len) {
+  // This function will append a string to the end of the row.
+  editorRowReserve(row, row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+  editorRowRxInvalidate(row, row->size);
+  row->size += len;
+  row->chars[row->size] = '\0';
+}
+
+void editorRowDelChar(editor_row *row, int at) {
+  // This function will delete the character at a given position in the row,
+  // all of its bytes when it is a UTF-8 sequence.
+  if (at < 0 || at >= row->size)
+    return;
+  int len = editorRowNextCx(row, at) - at;
+  editorRowOwn(row);
+  memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+  // memmove() will move the characters after the deleted one, including the
+  // null character, to the left.
+  row->size -= len;
+  editorRowRxInvalidate(row, at);
+}
+
+/* syntax highlighting */
+// A row is highlighted from the lexer state at the end of the row above it,
+// which every row keeps in hlstate. The states are worked out lazily, only
+// up to the rows being drawn, and E.hl.clean says how far they are known to
+// be right. An edit moves clean back to the edited row, and the rows after
+// it are lexed again only until a row ends in the same state it did before.
+// The highlight of the rows on screen is kept in E.hl.slots.
+
+int editorIsSeparator(int c) {
+  // This function will return 1 for the characters that end a word.
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}:&|!?^", c);
+}
+
+int editorHlLogLevel(const char *s, int n) {
+  // This function will return the highlight of a log level word, or
+  // HL_NORMAL when the n bytes of s are not one.
+  static const char *levels[] = {"FATAL", "PANIC", "CRIT",  "CRITICAL",
+                                 "ERROR", "ERR",   "WARN",  "WARNING",
+                                 "INFO",  "NOTICE", "DEBUG", "TRACE"};
+  static const int hls[] = {HL_ERROR, HL_ERROR, HL_ERROR, HL_ERROR,
+                            HL_ERROR, HL_ERROR, HL_WARN,  HL_WARN,
+                            HL_INFO,  HL_INFO,  HL_DEBUG, HL_DEBUG};
+  unsigned int j;
+  for (j = 0; j < sizeof(levels) / sizeof(levels[0]); j++)
+    if ((int)strlen(levels[j]) == n && strncasecmp(levels[j], s, n) == 0)
+      return hls[j];
+  return HL_NORMAL;
+}
+
+void editorHlLog(const char *s, int n, unsigned char *hl) {
+  // This function will highlight a row of a log file: the time stamp it
+  // starts with, log levels and quoted strings. Log rows carry no state.
+  int i = 0;
+  while (i < n && i < 40 &&
+         (isdigit((unsigned char)s[i]) || strchr("-:./T ,+Z[", s[i]))) {
+    // the time stamp, digits and the separators of a date and time.
+    hl[i] = HL_TIME;
+    i++;
+  }
+  while (i > 0 && !isdigit((unsigned char)s[i - 1]))
+    hl[--i] = HL_NORMAL;
+  // leave the separators after the last digit alone.
+  while (i < n) {
+    if (s[i] == '"') {
+      int j = i + 1;
+      while (j < n && s[j] != '"')
+        j++;
+      if (j < n)
+        j++;
+      memset(&hl[i], HL_STRING, j - i);
+      i = j;
+    } else if (isalpha((unsigned char)s[i]) &&
+               (i == 0 || editorIsSeparator(s[i - 1]))) {
+      int j = i;
+      while (j < n && isalpha((unsigned char)s[j]))
+        j++;
+      memset(&hl[i], editorHlLogLevel(&s[i], j - i), j - i);
+      i = j;
+    } else {
+      hl[i++] = HL_NORMAL;
+    }
+  }
+}
+
+int editorHlLex(editor_syntax *syn, const char *s, int n, int state,
+                unsigned char *hl) {
+  // This function will highlight the n bytes of s into hl, starting in the
+  // lexer state state, and return the state at the end. Without hl only the
+  // state is worked out, which skips everything but comments and strings.
+  if (syn->flags & HL_LOG) {
+    if (hl)
+      editorHlLog(s, n, hl);
+    return HL_STATE_NONE;
+  }
+  char *scs = syn->singleline_comment_start;
+  char *mcs = syn->multiline_comment_start;
+  char *mce = syn->multiline_comment_end;
+  int scslen = scs ? strlen(scs) : 0;
+  int mcslen = mcs ? strlen(mcs) : 0;
+  int mcelen = mce ? strlen(mce) : 0;
+  int shell = syn->flags & HL_SHELL;
+
+  int prevsep = 1;
+  int prevhl = HL_NORMAL;
+  int incomment = state == HL_STATE_COMMENT;
+  int instring = state == HL_STATE_DQUOTE  ? '"'
+                 : state == HL_STATE_SQUOTE ? '\''
+                                            : 0;
+  int i = 0;
+  if (hl && (syn->flags & HL_HIGHLIGHT_PREPROC)) {
+    // a preprocessor directive, # and the word after it.
+    while (i < n && isspace((unsigned char)s[i]))
+      hl[i++] = HL_NORMAL;
+    if (!incomment && !instring && i < n && s[i] == '#') {
+      hl[i++] = HL_PREPROC;
+      while (i < n && isspace((unsigned char)s[i]))
+        hl[i++] = HL_PREPROC;
+      while (i < n && isalpha((unsigned char)s[i]))
+        hl[i++] = HL_PREPROC;
+      prevsep = 0;
+    }
+  }
+
+#define HL_MARK(at, len, what)                                                 \
+  do {                                                                         \
+    if (hl)                                                                    \
+      memset(&hl[at], what, len);                                              \
+  } while (0)
+  while (i < n) {
+    char c = s[i];
+    if (scslen && !instring && !incomment && i + scslen <= n &&
+        !strncmp(&s[i], scs, scslen) &&
+        (!shell || i == 0 || isspace((unsigned char)s[i - 1]))) {
+      // a comment to the end of the row. In a shell script # only starts
+      // one at the start of a word.
+      HL_MARK(i, n - i, HL_COMMENT);
+      break;
+    }
+    if (mcslen && mcelen && !instring) {
+      if (incomment) {
+        if (i + mcelen <= n && !strncmp(&s[i], mce, mcelen)) {
+          HL_MARK(i, mcelen, HL_COMMENT);
+          i += mcelen;
+          incomment = 0;
+          prevsep = 1;
+        } else {
+          HL_MARK(i, 1, HL_COMMENT);
+          i++;
+        }
+        continue;
+      } else if (i + mcslen <= n && !strncmp(&s[i], mcs, mcslen)) {
+        HL_MARK(i, mcslen, HL_COMMENT);
+        i += mcslen;
+        incomment = 1;
+        continue;
+      }
+    }
+    if (syn->flags & HL_HIGHLIGHT_STRINGS) {
+      if (instring) {
+        HL_MARK(i, 1, HL_STRING);
+        if (c == '\\' && i + 1 < n && !(shell && instring == '\'')) {
+          // an escaped character, in a shell only outside single quotes.
+          HL_MARK(i + 1, 1, HL_STRING);
+          i += 2;
+          continue;
+        }
+        if (c == instring)
+          instring = 0;
+        i++;
+        prevsep = 1;
+        continue;
+      } else if (c == '"' || c == '\'') {
+        instring = c;
+        HL_MARK(i, 1, HL_STRING);
+        i++;
+        continue;
+      }
+    }
+    if (shell && c == '$') {
+      // a shell variable, $name, ${...} or a special one like $1 or $?.
+      // It can swallow a quote, so the state lexing needs it too.
+      int j = i + 1;
+      if (j < n && s[j] == '{') {
+        while (j < n && s[j] != '}')
+          j++;
+        if (j < n)
+          j++;
+      } else if (j < n && !isalnum((unsigned char)s[j]) && s[j] != '_') {
+        j++;
+      } else {
+        while (j < n && (isalnum((unsigned char)s[j]) || s[j] == '_'))
+          j++;
+      }
+      HL_MARK(i, j - i, HL_VARIABLE);
+      i = j;
+      prevsep = 0;
+      prevhl = HL_VARIABLE;
+      continue;
+    }
+    if (!hl) {
+      // nothing else changes the state.
+      i++;
+      continue;
+    }
+    if ((syn->flags & HL_HIGHLIGHT_NUMBERS) &&
+        ((isdigit((unsigned char)c) && (prevsep || prevhl == HL_NUMBER)) ||
+         (c == '.' && prevhl == HL_NUMBER))) {
+      hl[i++] = HL_NUMBER;
+      prevsep = 0;
+      prevhl = HL_NUMBER;
+      continue;
+    }
+    if (prevsep && syn->keywords) {
+      int j;
+      for (j = 0; syn->keywords[j]; j++) {
+        int klen = strlen(syn->keywords[j]);
+        int type = syn->keywords[j][klen - 1] == '|';
+        // a keyword ending in | is a type.
+        if (type)
+          klen--;
+        if (i + klen <= n && !strncmp(&s[i], syn->keywords[j], klen) &&
+            (i + klen == n || editorIsSeparator(s[i + klen]))) {
+          memset(&hl[i], type ? HL_TYPE : HL_KEYWORD, klen);
+          i += klen;
+          break;
+        }
+      }
+      if (syn->keywords[j]) {
+        prevsep = 0;
+        prevhl = HL_KEYWORD;
+        continue;
+      }
+    }
+    hl[i] = HL_NORMAL;
+    prevhl = HL_NORMAL;
+    prevsep = editorIsSeparator(c);
+    i++;
+  }
+#undef HL_MARK
+
+  if (incomment)
+    return HL_STATE_COMMENT;
+  if (instring && (shell || (n > 0 && s[n - 1] == '\\')))
+    // strings go on in the next row in a shell script, in C only after a
+    // backslash.
+    return instring == '"' ? HL_STATE_DQUOTE : HL_STATE_SQUOTE;
+  return HL_STATE_NONE;
+}
+
+int editorHlStart(int at) {
+  // This function will return the lexer state row at starts in, lexing the
+  // rows above it whose state is not known yet.
+  editor_syntax *syn = E.hl.syntax;
+  if (syn == NULL || (syn->flags & HL_LOG) || E.paged || at == 0)
+    return HL_STATE_NONE;
+  // log rows carry no state and a paged file is too big to lex from the top.
+  int in = E.hl.clean ? bufRow(E.hl.clean - 1)->hlstate : HL_STATE_NONE;
+  while (E.hl.clean < at) {
+    int k = E.hl.clean;
+    editor_row *row = bufRow(k);
+    int out = row->size > HL_ROW_MAX
+                  ? HL_STATE_NONE
+                  : editorHlLex(syn, row->chars, row->size, in, NULL);
+    int same = k < E.hl.computed && row->hlstate == out;
+    if (k < E.hl.computed && row->hlstate != out) {
+      E.hl.gen++;
+      if (E.hl.dirtyend < k + 2)
+        E.hl.dirtyend = k + 2;
+    }
+    // the rows below may look different now, and the next one has to be
+    // lexed again before the old states can be trusted.
+    row->hlstate = out;
+    in = out;
+    E.hl.clean = k + 1;
+    if (same && E.hl.clean >= E.hl.dirtyend) {
+      // the row ends like it did before, the rows below are still right.
+      E.hl.clean = E.hl.computed;
+      if (E.hl.clean < at)
+        in = bufRow(E.hl.clean - 1)->hlstate;
+    }
+    if (E.hl.computed < E.hl.clean)
+      E.hl.computed = E.hl.clean;
+  }
+  return bufRow(at - 1)->hlstate;
+}
+
+unsigned char *editorHlRow(editor_row *row, int at, int need) {
+  // This function will return the highlight of the first need bytes of row
+  // at, or NULL when the file has no syntax or the row is too long. It is
+  // kept for the next frame.
+  if (E.hl.syntax == NULL || row->size > HL_ROW_MAX)
+    return NULL;
+  if (need > row->size)
+    need = row->size;
+  hl_slot *slot = &E.hl.slots[at % HL_SLOTS];
+  if (slot->row == at && slot->gen == E.hl.gen && slot->len >= need)
+    return slot->hl;
+
+  int start = editorHlStart(at);
+  if (slot->cap < need) {
+    slot->cap = need;
+    slot->hl = realloc(slot->hl, need);
+    if (slot->hl == NULL)
+      die("realloc");
+  }
+  editorHlLex(E.hl.syntax, row->chars, need, start, slot->hl);
+  slot->row = at;
+  slot->gen = E.hl.gen;
+  slot->len = need;
+  if (at > E.hl.maxrow)
+    E.hl.maxrow = at;
+  return slot->hl;
+}
+
+void editorHlChanged(int at) {
+  // This function will note that the characters of row at changed.
+  if (at < E.hl.computed) {
+    if (E.hl.clean > at)
+      E.hl.clean = at;
+    if (E.hl.dirtyend < at + 1)
+      E.hl.dirtyend = at + 1;
+  }
+  if (E.hl.slots[at % HL_SLOTS].row == at)
+    E.hl.slots[at % HL_SLOTS].row = -1;
+}
+
+void editorHlShift(int at, int delta) {
+  // This function will note that a row was inserted at index at (delta 1)
+  // or deleted from it (delta -1).
+  if (at <= E.hl.maxrow)
+    E.hl.gen++;
+  // the rows in the slots moved.
+  if (at < E.hl.computed) {
+    E.hl.computed += delta;
+    if (E.hl.dirtyend > at)
+      E.hl.dirtyend += delta;
+    editorHlChanged(at);
+  }
+}
+
+void editorHlReset() {
+  // This function will forget every lexer state, for a buffer that was read
+  // again.
+  E.hl.clean = 0;
+  E.hl.computed = 0;
+  E.hl.dirtyend = 0;
+  E.hl.gen++;
+  E.hl.maxrow = -1;
+}
+
+const char *editorHlColor(int hl) {
+  // This function will return the escape sequence that draws highlight hl.
+  switch (hl) {
+  case HL_COMMENT:
+    return "\x1b[36m";
+  case HL_KEYWORD:
+    return "\x1b[33m";
+  case HL_TYPE:
+    return "\x1b[32m";
+  case HL_STRING:
+    return "\x1b[35m";
+  case HL_NUMBER:
+    return "\x1b[31m";
+  case HL_PREPROC:
+    return "\x1b[34m";
+  case HL_VARIABLE:
+    return "\x1b[32m";
+  case HL_TIME:
+    return "\x1b[36m";
+  case HL_ERROR:
+    return "\x1b[1;31m";
+  case HL_WARN:
+    return "\x1b[33m";
+  case HL_INFO:
+    return "\x1b[32m";
+  case HL_DEBUG:
+    return "\x1b[2m";
+  case HL_MATCH:
+    return "\x1b[30;43m";
+  }
+  return "";
+}
+
+void editorSelectSyntax() {
+  // This function will pick the syntax of the file from its name, or from
+  // the #! line of a script.
+  E.hl.syntax = NULL;
+  E.hl.gen++;
+  E.hl.clean = E.hl.computed = E.hl.dirtyend = 0;
+  if (E.filename == NULL)
+    return;
+  char *base = strrchr(E.filename, '/');
+  base = base ? base + 1 : E.filename;
+  char *ext = strrchr(base, '.');
+  unsigned int j;
+  for (j = 0; j < HLDB_ENTRIES; j++) {
+    editor_syntax *s = &HLDB[j];
+    int i;
+    for (i = 0; s->filematch[i]; i++) {
+      int isext = s->filematch[i][0] == '.';
+      // entries starting with . are extensions, the rest parts of a name.
+      if ((isext && ext && !strcmp(ext, s->filematch[i])) ||
+          (!isext && strstr(base, s->filematch[i]))) {
+        E.hl.syntax = s;
+        return;
+      }
+    }
+  }
+  if (E.numrows > 0) {
+    editor_row *row = bufRow(0);
+    if (row->size > 2 && !strncmp(row->chars, "#!", 2) &&
+        memmem(row->chars, row->size, "sh", 2))
+      E.hl.syntax = &HLDB[1];
+    // the #! line of a shell script.
+  }
+}
+
+/* editor functions */
+void editorInsertChar(int c) {
+  // This function will insert a character at the cursor position.
+  char ch = c;
+  if (!undoTyped(E.cy, E.cx, ch)) {
+    // a character typed right after the previous one goes in the same undo
+    // record, anything else starts a new edit.
+    undoBegin();
+    if (E.cy == E.numrows)
+      undoRecord(UNDO_ADD_ROW, E.cy, 0, NULL, 0);
+    undoRecord(UNDO_INSERT, E.cy, E.cx, &ch, 1);
+  }
+  E.undo.merge = 1;
+  if (E.cy == E.numrows) {
+    // If the cursor is at the end of the file then append a new row.
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(bufRow(E.cy), E.cx, c);
+  editorHlChanged(E.cy);
+  // Insert the character at the cursor position.
+  E.cx++;
+  E.dirty++;
+}
+
+void editorSplitRow() {
+  // This function will split the row at the cursor in two and move the
+  // cursor to the start of the second one.
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+  } else {
+    editor_row *row = bufRow(E.cy);
+    editorHlChanged(E.cy);
+    if (row->owned) {
+      editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    } else {
+      // the tail of a row that is still a view into the file is a view too.
+      editor_row *tail =
+          editorInsertRowView(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+      if (bufRow(E.cy)->shared) {
+        tail->shared = 1;
+        textBlockOf(tail->chars)->live++;
+      }
+    }
+    row = bufRow(E.cy);
+    // inserting a row may have moved the rows around, look the row up again.
+    if (row->owned) {
+      editorRowOwn(row);
+      // a row pinned by a save gets a fresh block before it is cut short.
+      row->chars[E.cx] = '\0';
+    }
+    row->size = E.cx;
+    editorRowRxInvalidate(row, E.cx);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+void editorInsertNewline() {
+  // This function will split the row at the cursor in two.
+  undoBegin();
+  if (E.cy == E.numrows)
+    undoRecord(UNDO_ADD_ROW, E.cy, 0, NULL, 0);
+  else
+    undoRecord(UNDO_INSERT, E.cy, E.cx, "\n", 1);
+  editorSplitRow();
+  E.dirty++;
+}
+
+void editorInsertRaw(const char *s, size_t len) {
+  // This function will insert a block of text at the cursor in one go. Every
+  // \n starts a new row, and the rows in between are created directly
+  // instead of being typed in character by character. The cursor ends up
+  // after the text.
+  size_t start = 0;
+  int first = 1;
+  editorHlChanged(E.cy);
+  while (1) {
+    size_t end = start + E.findbyte(&s[start], len - start, '\n');
+    // end is the position of the next line break.
+
+    if (end == len) {
+      // the last piece goes in front of the rest of the row the cursor was on.
+      editorRowInsertString(bufRow(E.cy), E.cx, &s[start], end - start);
+      editorHlChanged(E.cy);
+      E.cx += end - start;
+      break;
+    }
+    if (first) {
+      // the first piece is added to the row the cursor is on, which is then
+      // split at the cursor.
+      editorRowInsertString(bufRow(E.cy), E.cx, &s[start], end - start);
+      E.cx += end - start;
+      editorSplitRow();
+      first = 0;
+    } else {
+      editorInsertRowShared(E.cy, &s[start], end - start);
+      E.cy++;
+    }
+    start = end + 1;
+  }
+}
+
+void editorDeleteRaw(size_t len) {
+  // This function will delete len bytes after the cursor, the break between
+  // two rows counting as one byte. Rows that go away as a whole are deleted
+  // without being copied.
+  if (E.cy < E.numrows)
+    editorHlChanged(E.cy);
+  while (len > 0 && E.cy < E.numrows) {
+    editor_row *row = bufRow(E.cy);
+    if (E.cx < row->size) {
+      size_t n = row->size - E.cx;
+      if (n > len)
+        n = len;
+      editorRowOwn(row);
+      memmove(&row->chars[E.cx], &row->chars[E.cx + n],
+              row->size - E.cx - n + 1);
+      row->size -= n;
+      editorRowRxInvalidate(row, E.cx);
+      len -= n;
+      continue;
+    }
+    if (E.cy + 1 >= E.numrows)
+      break;
+    editor_row *next = bufRow(E.cy + 1);
+    if (len > (size_t)next->size) {
+      // the row break and the whole next row go.
+      len -= next->size + 1;
+      editorDelRow(E.cy + 1);
+      continue;
+    }
+    editorRowAppendString(row, next->chars, next->size);
+    editorDelRow(E.cy + 1);
+    len--;
+  }
+}
+
+void editorInsertText(const char *s, size_t len) {
+  // This function will insert pasted text at the cursor. Line breaks (\n,
+  // \r\n or \r) start new rows.
+  char *text = NULL;
+  if (memchr(s, '\r', len)) {
+    // turn every line break into \n first, so the text can be undone and
+    // redone as it is.
+    text = malloc(len);
+    if (text == NULL)
+      die("malloc");
+    size_t i, n = 0;
+    for (i = 0; i < len; i++) {
+      if (s[i] == '\r') {
+        text[n++] = '\n';
+        if (i + 1 < len && s[i + 1] == '\n')
+          i++;
+      } else {
+        text[n++] = s[i];
+      }
+    }
+    s = text;
+    len = n;
+  }
+
+  undoBegin();
+  if (E.cy == E.numrows) {
+    undoRecord(UNDO_ADD_ROW, E.cy, 0, NULL, 0);
+    editorInsertRow(E.numrows, "", 0);
+  }
+  undoRecord(UNDO_INSERT, E.cy, E.cx, s, len);
+  editorInsertRaw(s, len);
+  free(text);
+  E.dirty++;
+}
+
+void editorDelChar() {
+  // This function will delete the character left of the cursor, joining the
+  // row with the one above when the cursor is at its start.
+  if (E.cy == E.numrows)
+    return;
+  if (E.cx == 0 && E.cy == 0)
+    return;
+
+  editor_row *row = bufRow(E.cy);
+  undoBegin();
+  if (E.cx > 0) {
+    int prev = editorRowPrevCx(row, E.cx);
+    undoRecord(UNDO_DELETE, E.cy, prev, &row->chars[prev], E.cx - prev);
+    editorRowDelChar(row, prev);
+    editorHlChanged(E.cy);
+    E.cx = prev;
+  } else {
+    editor_row *prev = bufRow(E.cy - 1);
+    undoRecord(UNDO_DELETE, E.cy - 1, prev->size, "\n", 1);
+    E.cx = prev->size;
+    editorRowAppendString(prev, row->chars, row->size);
+    editorHlChanged(E.cy - 1);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+  E.dirty++;
+}
+
+/* undo */
+// Every edit is recorded as the text it inserted or deleted and where. The
+// records are kept in order in E.undo.ops and their text in a log of chunks
+// that is only ever appended to, so undoing an edit costs as much as the
+// edit did and never copies rows that it did not touch.
+
+char *undoStore(const char *s, size_t len, long long *seq) {
+  // This function will copy len bytes of s to the end of the undo log and
+  // return where they are. seq is set to the number of the chunk they are in.
+  undo_log *u = &E.undo;
+  if (u->tail == NULL || u->tail->size - u->tail->used < len) {
+    size_t size = len > UNDO_CHUNK_BYTES ? len : UNDO_CHUNK_BYTES;
+    undo_chunk *c = malloc(sizeof(undo_chunk) + size);
+    if (c == NULL)
+      die("malloc");
+    c->next = NULL;
+    c->seq = u->nextseq++;
+    c->size = size;
+    c->used = 0;
+    if (u->tail)
+      u->tail->next = c;
+    else
+      u->head = c;
+    u->tail = c;
+    u->bytes += sizeof(undo_chunk) + size;
+  }
+  char *text = (char *)(u->tail + 1) + u->tail->used;
+  // the text of a chunk follows its header.
+  if (len)
+    memcpy(text, s, len);
+  u->tail->used += len;
+  *seq = u->tail->seq;
+  return text;
+}
+
+void undoFreeChunks(long long keep) {
+  // This function will free the chunks of the undo log older than chunk
+  // keep, or every chunk when keep is -1.
+  undo_log *u = &E.undo;
+  while (u->head && (keep == -1 || u->head->seq < keep)) {
+    undo_chunk *c = u->head;
+    u->head = c->next;
+    u->bytes -= sizeof(undo_chunk) + c->size;
+    free(c);
+  }
+  if (u->head == NULL)
+    u->tail = NULL;
+}
+
+void undoDropRedo() {
+  // This function will forget the edits that were undone, they cannot be
+  // redone once something else is edited. Their text is at the end of the
+  // log, which is cut back to where the first of them starts.
+  undo_log *u = &E.undo;
+  if (u->cur == u->n)
+    return;
+  undo_op *op = &u->ops[u->cur];
+  undo_chunk *c = u->head;
+  while (c && c->seq != op->chunk)
+    c = c->next;
+  if (c) {
+    c->used = op->text - (char *)(c + 1);
+    while (c->next) {
+      undo_chunk *next = c->next;
+      c->next = next->next;
+      u->bytes -= sizeof(undo_chunk) + next->size;
+      free(next);
+    }
+    u->tail = c;
+  }
+  u->n = u->cur;
+}
+
+void undoClear() {
+  // This function will forget the whole undo history.
+  undo_log *u = &E.undo;
+  undoFreeChunks(-1);
+  u->bytes -= sizeof(undo_op) * u->cap;
+  free(u->ops);
+  u->ops = NULL;
+  u->first = u->n = u->cur = u->cap = 0;
+  u->merge = 0;
+}
+
+void undoShrink() {
+  // This function will move the records that are left to the start of ops
+  // and give back the room of the forgotten ones, so an edit that was
+  // forgotten stops counting against the memory limit.
+  undo_log *u = &E.undo;
+  int cap = u->cap;
+  while (cap > 256 && u->n - u->first <= cap / 2)
+    cap /= 2;
+  if (cap == u->cap)
+    return;
+  memmove(u->ops, &u->ops[u->first], sizeof(undo_op) * (u->n - u->first));
+  u->n -= u->first;
+  u->cur -= u->first;
+  u->first = 0;
+  undo_op *ops = realloc(u->ops, sizeof(undo_op) * cap);
+  if (ops == NULL)
+    return;
+  u->bytes -= sizeof(undo_op) * (u->cap - cap);
+  u->ops = ops;
+  u->cap = cap;
+}
+
+void undoEvict() {
+  // This function will forget the oldest edits until the undo history fits
+  // in its memory limit. Edits go whole, so the records that are left always
+  // undo back to some earlier state of the buffer. When the edit being made
+  // does not fit on its own the whole history goes and the edit is not kept.
+  undo_log *u = &E.undo;
+  while (u->bytes > u->limit && u->first < u->n) {
+    if (u->first == u->cur) {
+      // only edits that can be redone are left, and they have to be redone
+      // from the oldest, so they all go.
+      undoDropRedo();
+    } else if (u->ops[u->first].group == u->ops[u->n - 1].group) {
+      undoClear();
+      u->dropped = u->group;
+      editorSetStatusMessage("Edit too large to undo, undo history cleared");
+      return;
+    } else {
+      long group = u->ops[u->first].group;
+      while (u->ops[u->first].group == group)
+        u->first++;
+      undoShrink();
+    }
+    if (u->first == u->n)
+      undoClear();
+    else
+      undoFreeChunks(u->ops[u->first].chunk);
+  }
+}
+
+int undoDropped() {
+  // This function will return 1 when the edit being made was too large for
+  // the undo history.
+  return E.undo.dropped == E.undo.group;
+}
+
+void undoBegin() {
+  // This function will start a new edit. Everything recorded until the next
+  // call is undone and redone in one step. A replayed macro is one edit.
+  if (E.macro.playing)
+    return;
+  E.undo.group++;
+}
+
+void undoRecord(int type, int row, int col, const char *s, size_t len) {
+  // This function will record that the len bytes of s were inserted or
+  // deleted at row and col, or that an empty row was added at the end.
+  undo_log *u = &E.undo;
+  if (u->applying)
+    return;
+  journalRecord(type == UNDO_INSERT   ? JOURNAL_INSERT
+                : type == UNDO_DELETE ? JOURNAL_DELETE
+                                      : JOURNAL_ADD_ROW,
+                row, col, s, len);
+  // the swap file gets every edit as it is made.
+  if (u->dropped == u->group)
+    return;
+  undoDropRedo();
+  if (u->n == u->cap) {
+    if (u->first > u->cap / 2) {
+      // most of the array holds forgotten records, move the rest down.
+      memmove(u->ops, &u->ops[u->first], sizeof(undo_op) * (u->n - u->first));
+      u->n -= u->first;
+      u->cur -= u->first;
+      u->first = 0;
+    } else {
+      u->bytes -= sizeof(undo_op) * u->cap;
+      u->cap = u->cap ? u->cap * 2 : 256;
+      u->ops = realloc(u->ops, sizeof(undo_op) * u->cap);
+      if (u->ops == NULL)
+        die("realloc");
+      u->bytes += sizeof(undo_op) * u->cap;
+    }
+  }
+  undo_op *op = &u->ops[u->n++];
+  op->type = type;
+  op->row = row;
+  op->col = col;
+  op->len = len;
+  op->text = undoStore(s, len, &op->chunk);
+  op->group = u->group;
+  op->cx = E.cx;
+  op->cy = E.cy;
+  u->cur = u->n;
+  u->merge = 0;
+  undoEvict();
+}
+
+int undoTyped(int row, int col, char ch) {
+  // This function will add a typed character to the record of the previous
+  // one when it was typed right before it, and return 1 if it did.
+  undo_log *u = &E.undo;
+  if (!u->merge || u->applying || u->cur != u->n || u->n == u->first)
+    return 0;
+  undo_op *op = &u->ops[u->n - 1];
+  if (op->type != UNDO_INSERT || op->row != row || op->col + op->len != col)
+    return 0;
+  undo_chunk *c = u->tail;
+  if (op->text + op->len == (char *)(c + 1) + c->used && c->used < c->size) {
+    // the record is the last thing in the log, the character goes after it.
+    op->text[op->len++] = ch;
+    c->used++;
+  } else {
+    // move the record to the end of the log first.
+    char *text = undoStore(op->text, op->len + 1, &op->chunk);
+    text[op->len++] = ch;
+    op->text = text;
+  }
+  journalTyped(row, col, ch);
+  undoEvict();
+  return 1;
+}
+
+void undoApply(undo_op *op, int undo) {
+  // This function will redo an edit, or undo it when undo is set.
+  E.cy = op->row;
+  E.cx = op->col;
+  if (op->type == UNDO_ADD_ROW) {
+    journalRecord(undo ? JOURNAL_DEL_ROW : JOURNAL_ADD_ROW, op->row, 0, NULL,
+                  0);
+    if (undo)
+      editorDelRow(op->row);
+    else
+      editorInsertRow(op->row, "", 0);
+  } else if ((op->type == UNDO_INSERT) != undo) {
+    journalRecord(JOURNAL_INSERT, op->row, op->col, op->text, op->len);
+    editorInsertRaw(op->text, op->len);
+  } else {
+    journalRecord(JOURNAL_DELETE, op->row, op->col, NULL, op->len);
+    editorDeleteRaw(op->len);
+  }
+  E.dirty++;
+}
+
+void editorUndo() {
+  // This function will undo the last edit and put the cursor where it was
+  // before that edit.
+  undo_log *u = &E.undo;
+  if (u->cur == u->first) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  long group = u->ops[u->cur - 1].group;
+  u->applying = 1;
+  while (u->cur > u->first && u->ops[u->cur - 1].group == group)
+    undoApply(&u->ops[--u->cur], 1);
+  u->applying = 0;
+  E.cx = u->ops[u->cur].cx;
+  E.cy = u->ops[u->cur].cy;
+}
+
+void editorRedo() {
+  // This function will redo the last edit that was undone.
+  undo_log *u = &E.undo;
+  if (u->cur == u->n) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+  long group = u->ops[u->cur].group;
+  u->applying = 1;
+  while (u->cur < u->n && u->ops[u->cur].group == group)
+    undoApply(&u->ops[u->cur++], 0);
+  u->applying = 0;
+}
+
+/* journal */
+// The edits that were not saved yet are kept in a swap file next to the file,
+// .name.cedit, so they survive a crash. The swap file starts with the size
+// and time stamp of the file the edits are for, followed by the edits in the
+// order they were made, each a journal_rec and the text it inserts. Records
+// are only ever appended, the edits of JOURNAL_SYNC_MS go in one write() and
+// one fdatasync() on the journal thread, so typing never waits for the disk.
+// When the swap file has grown large it is compacted: it is written again as
+// hunks that say which lines of the file are different now, the lines that
+// did not change are not copied. Recovery replays the swap file on the file
+// once it is loaded and costs as much as the edits, not the file.
+
+void journalPut(journal_buf *jb, const void *s, size_t len) {
+  // This function will append len bytes of s to jb.
+  if (jb->len + len > jb->cap) {
+    size_t cap = jb->cap ? jb->cap : ABUF_MIN;
+    while (cap < jb->len + len)
+      cap *= 2;
+    char *b = realloc(jb->b, cap);
+    if (b == NULL)
+      die("realloc");
+    jb->b = b;
+    jb->cap = cap;
+  }
+  if (len)
+    memcpy(jb->b + jb->len, s, len);
+  jb->len += len;
+}
+
+char *journalPath(const char *filename) {
+  // This function will return the name of the swap file of filename, which
+  // is the file name with a dot in front and .cedit after it.
+  const char *base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+  size_t dirlen = base - filename;
+  char *path = malloc(dirlen + strlen(base) + 8);
+  if (path == NULL)
+    die("malloc");
+  memcpy(path, filename, dirlen);
+  sprintf(path + dirlen, ".%s.cedit", base);
+  return path;
+}
+
+void journalBase(struct stat *st) {
+  // This function will make the file st describes the one the edits of the
+  // journal are for.
+  journal_head *head = &E.journal.head;
+  memcpy(head->magic, JOURNAL_MAGIC, sizeof(head->magic));
+  head->size = st->st_size;
+  head->sec = st->st_mtim.tv_sec;
+  head->nsec = st->st_mtim.tv_nsec;
+}
+
+int journalRun(journal *j, int job) {
+  // This function will do a job of the journal thread and return 0 or the
+  // error it ran into. A new swap file is written next to the old one and
+  // renamed over it, so there is always a whole swap file on disk.
+  if (job == JOURNAL_REMOVE) {
+    if (j->fd != -1)
+      close(j->fd);
+    j->fd = -1;
+    if (unlink(j->path) == -1 && errno != ENOENT)
+      return errno;
+    return 0;
+  }
+
+  int fd = j->fd;
+  char *tmp = NULL;
+  if (job == JOURNAL_REWRITE) {
+    size_t len = strlen(j->path);
+    tmp = malloc(len + 8);
+    if (tmp == NULL)
+      return ENOMEM;
+    memcpy(tmp, j->path, len);
+    memcpy(tmp + len, ".XXXXXX", 8);
+    fd = mkstemp(tmp);
+    // mkstemp() makes the file readable by its owner only, the edits may
+    // be private.
+    if (fd == -1) {
+      free(tmp);
+      return errno;
+    }
+  }
+
+  int err = 0;
+  size_t done = 0;
+  while (done < j->sending.len) {
+    ssize_t n = write(fd, j->sending.b + done, j->sending.len - done);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      err = errno;
+      break;
+    }
+    done += n;
+  }
+  if (!err && (job == JOURNAL_REWRITE ? fsync(fd) : fdatasync(fd)) == -1)
+    err = errno;
+  // an append only needs its data on disk, the size comes along with it.
+  if (job == JOURNAL_APPEND)
+    return err;
+
+  if (!err && rename(tmp, j->path) == -1)
+    err = errno;
+  if (err) {
+    close(fd);
+    unlink(tmp);
+  } else {
+    editorSyncDir(j->path);
+    if (j->fd != -1)
+      close(j->fd);
+    j->fd = fd;
+    // the records after this are appended to the new file.
+  }
+  free(tmp);
+  return err;
+}
+
+void *journalWorker(void *arg) {
+  // This function will run on a thread of its own and do the jobs the main
+  // thread hands it, one at a time.
+  journal *j = arg;
+  pthread_mutex_lock(&j->lock);
+  while (1) {
+    while (j->job == JOURNAL_IDLE)
+      pthread_cond_wait(&j->cond, &j->lock);
+    int job = j->job;
+    pthread_mutex_unlock(&j->lock);
+
+    int err = journalRun(j, job);
+
+    pthread_mutex_lock(&j->lock);
+    j->err = err;
+    j->job = JOURNAL_IDLE;
+    pthread_cond_broadcast(&j->cond);
+    write(E.wakepipe[1], "j", 1);
+  }
+  return NULL;
+}
+
+int journalBusy() {
+  // This function will return 1 while the journal thread is doing a job.
+  journal *j = &E.journal;
+  if (!j->running)
+    return 0;
+  pthread_mutex_lock(&j->lock);
+  int busy = j->job != JOURNAL_IDLE;
+  pthread_mutex_unlock(&j->lock);
+  return busy;
+}
+
+void journalWait() {
+  // This function will wait until the journal thread is done with its job.
+  journal *j = &E.journal;
+  if (!j->running)
+    return;
+  pthread_mutex_lock(&j->lock);
+  while (j->job != JOURNAL_IDLE)
+    pthread_cond_wait(&j->cond, &j->lock);
+  pthread_mutex_unlock(&j->lock);
+}
+
+void journalSend(int job) {
+  // This function will hand a job to the journal thread, which must be idle.
+  // For a write the thread gets pending and pending gets the buffer the
+  // thread wrote last, so both are reused.
+  journal *j = &E.journal;
+  if (job != JOURNAL_REMOVE) {
+    journal_buf sent = j->sending;
+    j->sending = j->pending;
+    j->pending = sent;
+    j->pending.len = 0;
+  }
+  if (job == JOURNAL_APPEND)
+    j->size += j->sending.len;
+  else
+    j->size = job == JOURNAL_REWRITE ? j->sending.len : 0;
+  j->rewrite = 0;
+  j->haslast = 0;
+  j->due = 0;
+
+  if (!j->running &&
+      pthread_create(&j->thread, NULL, journalWorker, j) == 0)
+    j->running = 1;
+  if (!j->running) {
+    // without a thread the main thread writes the swap file itself.
+    j->err = journalRun(j, job);
+    return;
+  }
+  pthread_mutex_lock(&j->lock);
+  j->job = job;
+  pthread_cond_broadcast(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+}
+
+int journalStart() {
+  // This function will start a new swap file for the edits about to be made
+  // to the file as it is on disk, and return 0 when there can be none.
+  journal *j = &E.journal;
+  struct stat st;
+  if (stat(E.filename, &st) == -1 || !S_ISREG(st.st_mode)) {
+    // only a regular file can be read again to replay the edits on.
+    j->off = 1;
+    return 0;
+  }
+  if (j->path == NULL)
+    j->path = journalPath(E.filename);
+  journalBase(&st);
+  j->pending.len = 0;
+  journalPut(&j->pending, &j->head, sizeof(j->head));
+  j->active = 1;
+  j->rewrite = 1;
+  j->remove = 0;
+  j->haslast = 0;
+  j->compacted = 0;
+  return 1;
+}
+
+int journalOn() {
+  // This function will return 1 when edits are recorded in a swap file.
+  journal *j = &E.journal;
+  return !j->off && !j->recover && E.filename != NULL;
+}
+
+void journalRecord(int type, int row, int col, const char *s, size_t len) {
+  // This function will add an edit to the records waiting to be written to
+  // the swap file. Only inserts carry their text, a delete just says how
+  // many bytes went.
+  journal *j = &E.journal;
+  if (!journalOn())
+    return;
+  if (!j->active && !journalStart())
+    return;
+  journal_rec rec = {type, row, col, len};
+  int text = type == JOURNAL_INSERT;
+  j->last = j->pending.len;
+  j->haslast = text && !j->saving;
+  journalPut(&j->pending, &rec, sizeof(rec));
+  if (text)
+    journalPut(&j->pending, s, len);
+  if (j->saving) {
+    journalPut(&j->during, &rec, sizeof(rec));
+    if (text)
+      journalPut(&j->during, s, len);
+  }
+  if (j->due == 0)
+    j->due = editorNow() + JOURNAL_SYNC_MS / 1000.0;
+}
+
+void journalTyped(int row, int col, char ch) {
+  // This function will add a typed character to the insert right before it
+  // when that one was not written yet, so typing a word costs one record.
+  journal *j = &E.journal;
+  journal_rec rec;
+  if (j->haslast) {
+    memcpy(&rec, j->pending.b + j->last, sizeof(rec));
+    if (rec.a == row && rec.b + (int64_t)rec.len == col &&
+        j->last + sizeof(rec) + rec.len == j->pending.len) {
+      rec.len++;
+      memcpy(j->pending.b + j->last, &rec, sizeof(rec));
+      journalPut(&j->pending, &ch, 1);
+      return;
+    }
+  }
+  journalRecord(JOURNAL_INSERT, row, col, &ch, 1);
+}
+
+int journalCompareRegion(const void *a, const void *b) {
+  // This function will order regions by where they are in memory.
+  uintptr_t x = (uintptr_t)((const journal_region *)a)->ptr;
+  uintptr_t y = (uintptr_t)((const journal_region *)b)->ptr;
+  return x < y ? -1 : x > y;
+}
+
+void journalSetRegions(journal_region *regions, int n) {
+  // This function will say which bytes of the file on disk are in memory,
+  // taking over the array regions.
+  journal *j = &E.journal;
+  free(j->regions);
+  if (n > 1)
+    qsort(regions, n, sizeof(journal_region), journalCompareRegion);
+  j->regions = regions;
+  j->nregions = n;
+}
+
+void editorJournalMapped() {
+  // This function will tell the journal that the file on disk is the one
+  // that was just opened, so its mapping holds all of it.
+  journal_region *r = NULL;
+  if (E.map) {
+    r = malloc(sizeof(journal_region));
+    if (r == NULL)
+      die("malloc");
+    r->ptr = E.map;
+    r->off = 0;
+    r->len = E.maplen;
+    r->nl = 0;
+  }
+  journalSetRegions(r, r ? 1 : 0);
+}
+
+journal_region *journalRegionOf(const char *s, size_t len) {
+  // This function will return the region the len bytes at s are in, or NULL
+  // when they are not in the file on disk.
+  journal *j = &E.journal;
+  int lo = 0, hi = j->nregions;
+  while (lo < hi) {
+    // find the first region that starts after s.
+    int mid = (lo + hi) / 2;
+    if ((uintptr_t)j->regions[mid].ptr <= (uintptr_t)s)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return NULL;
+  journal_region *r = &j->regions[lo - 1];
+  if ((uintptr_t)s + len > (uintptr_t)r->ptr + r->len)
+    return NULL;
+  return r;
+}
+
+int journalLine(editor_row *row, off_t pos, off_t *start, off_t *end) {
+  // This function will return 1 when row is a whole line of the file on
+  // disk that starts at or after byte pos, and set start and end to where
+  // the line and its line break are in the file.
+  if (row->owned)
+    return 0;
+  journal_region *r = journalRegionOf(row->chars, row->size);
+  if (r == NULL)
+    return 0;
+  off_t off = r->off + (row->chars - r->ptr);
+  if (off < pos || off >= E.journal.head.size)
+    // a row at the very end is one the last line was split into.
+    return 0;
+  if (off != pos && row->chars != r->ptr && row->chars[-1] != '\n')
+    // the row is the tail of a line that was split.
+    return 0;
+  const char *p = row->chars + row->size, *rend = r->ptr + r->len;
+  while (p < rend && *p == '\r')
+    p++;
+  // the carriage returns loading removed.
+  if (p < rend && *p == '\n')
+    *end = r->off + (p - r->ptr) + 1;
+  else if (p == rend && r->nl)
+    *end = r->off + r->len + 1;
+  else if (p == rend && r->off + (off_t)r->len == E.journal.head.size)
+    *end = E.journal.head.size;
+  else
+    // the row was cut short.
+    return 0;
+  *start = off;
+  return *end <= E.journal.head.size;
+}
+
+void journalEndHunk(journal_walk *w, off_t end) {
+  // This function will finish the hunk that replaces the lines from w->pos
+  // to end.
+  journal *j = &E.journal;
+  journal_rec rec = {JOURNAL_HUNK, w->pos, end, 0};
+  if (w->open) {
+    rec.len = j->pending.len - w->at - sizeof(rec);
+    memcpy(j->pending.b + w->at, &rec, sizeof(rec));
+  } else {
+    journalPut(&j->pending, &rec, sizeof(rec));
+  }
+  w->open = 0;
+}
+
+void journalCompactRow(editor_row *row, void *arg) {
+  // This function will add a row to a compaction. A row that is the next
+  // line of the file only moves past it, any other row goes in a hunk as
+  // text.
+  journal *j = &E.journal;
+  journal_walk *w = arg;
+  off_t start, end;
+  if (journalLine(row, w->pos, &start, &end)) {
+    if (w->open || start != w->pos)
+      journalEndHunk(w, start);
+    w->pos = end;
+    return;
+  }
+  if (!w->open) {
+    journal_rec rec = {JOURNAL_HUNK, 0, 0, 0};
+    w->at = j->pending.len;
+    journalPut(&j->pending, &rec, sizeof(rec));
+    w->open = 1;
+    // the header is filled in once the hunk ends.
+  }
+  journalPut(&j->pending, row->chars, row->size);
+  journalPut(&j->pending, "\n", 1);
+}
+
+void journalCompact() {
+  // This function will replace the records waiting to be written with a
+  // whole new swap file that has the buffer as hunks against the file. Each
+  // row is looked at once, but only the rows that are not lines of the file
+  // are copied.
+  journal *j = &E.journal;
+  journal_walk w;
+  memset(&w, 0, sizeof(w));
+  j->pending.len = 0;
+  journalPut(&j->pending, &j->head, sizeof(j->head));
+  bufWalk(E.root, journalCompactRow, &w);
+  if (w.open || w.pos != j->head.size)
+    journalEndHunk(&w, j->head.size);
+  j->rewrite = 1;
+}
+
+void editorJournalSaving() {
+  // This function will note that a save started. The edits made while it
+  // runs are kept apart, they are all the swap file needs once it is done.
+  journal *j = &E.journal;
+  j->saving = 1;
+  j->during.len = 0;
+  j->haslast = 0;
+}
+
+void editorJournalSaved(save_job *job) {
+  // This function will bring the journal up to date after a save. The file
+  // on disk now has every edit but the ones made during the save, the swap
+  // file goes or starts over with just those.
+  journal *j = &E.journal;
+  j->saving = 0;
+  if (job->err)
+    return;
+  journalSetRegions(job->regions, job->nregions);
+  job->regions = NULL;
+  job->nregions = 0;
+  job->regioncap = 0;
+  if (j->off)
+    return;
+
+  j->pending.len = 0;
+  j->haslast = 0;
+  j->due = 0;
+  j->rewrite = 0;
+  if (E.dirty == 0) {
+    if (j->active)
+      j->remove = 1;
+    j->active = 0;
+    return;
+  }
+  if (!j->active || !journalStart())
+    return;
+  journalPut(&j->pending, j->during.b, j->during.len);
+  j->due = editorNow() + JOURNAL_SYNC_MS / 1000.0;
+}
+
+int journalRowAt(off_t off, int hi) {
+  // This function will return the first of the rows before hi that starts
+  // at or after byte off of the mapping. The rows must all be views of it.
+  int lo = 0;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (bufRow(mid)->chars - E.map < off)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int journalNext(size_t *at, journal_rec *rec, const char **text) {
+  // This function will read the record at *at of the swap file being
+  // recovered and move *at past it, or return 0 when there is no whole
+  // record there.
+  journal *j = &E.journal;
+  if (j->recoverlen - *at < sizeof(*rec))
+    return 0;
+  memcpy(rec, j->recover + *at, sizeof(*rec));
+  size_t len = rec->type == JOURNAL_INSERT || rec->type == JOURNAL_HUNK
+                   ? rec->len
+                   : 0;
+  if (rec->type < JOURNAL_INSERT || rec->type > JOURNAL_HUNK ||
+      j->recoverlen - *at - sizeof(*rec) < len)
+    // a record the crash cut short.
+    return 0;
+  *text = j->recover + *at + sizeof(*rec);
+  *at += sizeof(*rec) + len;
+  return 1;
+}
+
+int journalApply(journal_rec *rec, const char *text) {
+  // This function will make an edit of the swap file again, or return 0
+  // when it does not fit the buffer.
+  int64_t row = rec->a;
+  if (rec->type == JOURNAL_ADD_ROW) {
+    if (row < 0 || row > E.numrows)
+      return 0;
+    editorInsertRow(row, "", 0);
+    E.cy = row;
+  } else if (rec->type == JOURNAL_DEL_ROW) {
+    if (row < 0 || row >= E.numrows)
+      return 0;
+    editorDelRow(row);
+    E.cy = row;
+  } else {
+    if (row < 0 || row >= E.numrows || rec->b < 0 ||
+        rec->b > bufRow(row)->size)
+      return 0;
+    E.cy = row;
+    E.cx = rec->b;
+    if (rec->type == JOURNAL_INSERT)
+      editorInsertRaw(text, rec->len);
+    else
+      editorDeleteRaw(rec->len);
+  }
+  return 1;
+}
+
+int journalApplyHunks(size_t from, size_t to) {
+  // This function will apply the hunks of a compacted swap file, which are
+  // between from and to. The rows every hunk replaces are found by where
+  // they are in the mapping before any is applied, so a hunk that does not
+  // fit leaves the buffer as it was. They are applied from the last to the
+  // first, then the rows before a hunk still have the places found.
+  journal_hunk *hunks = NULL;
+  int n = 0, cap = 0, k;
+  size_t at = from;
+  journal_rec rec;
+  const char *text;
+  off_t end = 0;
+  while (at < to && journalNext(&at, &rec, &text)) {
+    if (rec.a < end || rec.b < rec.a || rec.b > (int64_t)E.maplen) {
+      free(hunks);
+      return 0;
+    }
+    end = rec.b;
+    int first = journalRowAt(rec.a, E.numrows);
+    int last = journalRowAt(rec.b, E.numrows);
+    if ((first < E.numrows && bufRow(first)->chars - E.map != rec.a) ||
+        (last < E.numrows && bufRow(last)->chars - E.map != rec.b)) {
+      // the hunk does not start and end at a line of the file.
+      free(hunks);
+      return 0;
+    }
+    if (n == cap) {
+      cap = cap ? cap * 2 : 64;
+      hunks = realloc(hunks, sizeof(journal_hunk) * cap);
+      if (hunks == NULL)
+        die("realloc");
+    }
+    hunks[n].at = at - sizeof(rec) - rec.len;
+    hunks[n].first = first;
+    hunks[n].last = last;
+    n++;
+  }
+
+  for (k = n - 1; k >= 0; k--) {
+    at = hunks[k].at;
+    journalNext(&at, &rec, &text);
+    int first = hunks[k].first, j;
+    for (j = first; j < hunks[k].last; j++)
+      editorDelRow(first);
+    size_t start = 0, row = first;
+    while (start < rec.len) {
+      size_t len = E.findbyte(text + start, rec.len - start, '\n');
+      editorInsertRowShared(row++, text + start, len);
+      start += len + 1;
+    }
+  }
+  free(hunks);
+  return 1;
+}
+
+void journalReplay() {
+  // This function will make the edits of the swap file found when the file
+  // was opened, now that all of it is loaded. The swap file is cut back to
+  // its last whole record and the edits made from now on are added to it.
+  journal *j = &E.journal;
+  double start = editorNow();
+  size_t at = sizeof(journal_head), good = at;
+  journal_rec rec;
+  const char *text;
+  long edits = 0;
+
+  while (journalNext(&at, &rec, &text) && rec.type == JOURNAL_HUNK) {
+    good = at;
+    edits++;
+  }
+  if (edits && !journalApplyHunks(sizeof(journal_head), good)) {
+    editorSetStatusMessage("%.30s does not fit the file, not recovered",
+                           j->path);
+    close(j->fd);
+    j->fd = -1;
+    j->off = 1;
+    // the swap file is left alone for whoever knows better.
+    goto done;
+  }
+  at = good;
+  while (journalNext(&at, &rec, &text) && rec.type != JOURNAL_HUNK &&
+         journalApply(&rec, text)) {
+    good = at;
+    edits++;
+  }
+
+  if (ftruncate(j->fd, good) == -1 || lseek(j->fd, good, SEEK_SET) == -1) {
+    close(j->fd);
+    j->fd = -1;
+  }
+  j->size = good;
+  j->compacted = good;
+  if (E.cy > E.numrows)
+    E.cy = E.numrows;
+  if (E.cy < E.numrows && E.cx > bufRow(E.cy)->size)
+    E.cx = bufRow(E.cy)->size;
+  else if (E.cy == E.numrows)
+    E.cx = 0;
+  if (edits == 0) {
+    // there was nothing in it.
+    j->remove = 1;
+    goto done;
+  }
+  j->active = j->fd != -1;
+  E.dirty += edits;
+  editorSetStatusMessage("Recovered %ld edits from %.30s in %.2fs", edits,
+                         j->path, editorNow() - start);
+
+done:
+  free(j->recover);
+  j->recover = NULL;
+  j->recoverlen = 0;
+  E.redraw = 1;
+}
+
+void editorJournalRecover(const char *filename, struct stat *st) {
+  // This function will look for a swap file a crashed editor left behind
+  // when filename is first opened. One that has edits for this very version
+  // of the file is read in and replayed once the file has loaded, until
+  // then the buffer cannot be changed.
+  journal *j = &E.journal;
+  if (j->off || j->checked)
+    return;
+  j->checked = 1;
+  char *path = journalPath(filename);
+  int fd = open(path, O_RDWR);
+  struct stat jst;
+  if (fd == -1 || fstat(fd, &jst) == -1) {
+    if (fd != -1)
+      close(fd);
+    free(path);
+    return;
+  }
+
+  char *buf = malloc(jst.st_size > 0 ? jst.st_size : 1);
+  if (buf == NULL)
+    die("malloc");
+  ssize_t n = 0, got;
+  while (n < jst.st_size &&
+         (got = pread(fd, buf + n, jst.st_size - n, n)) > 0)
+    n += got;
+  journal_head head;
+  if (n >= (ssize_t)sizeof(head))
+    memcpy(&head, buf, sizeof(head));
+  if (n < (ssize_t)sizeof(head) ||
+      memcmp(head.magic, JOURNAL_MAGIC, sizeof(head.magic)) != 0 ||
+      head.size != st->st_size || head.sec != st->st_mtim.tv_sec ||
+      head.nsec != st->st_mtim.tv_nsec) {
+    // the file changed after the swap file was made, its edits would go to
+    // the wrong places. It is neither replayed nor overwritten.
+    editorSetStatusMessage("%.30s is for another version, not recovered",
+                           path);
+    j->off = 1;
+    close(fd);
+    free(buf);
+    free(path);
+    return;
+  }
+  j->path = path;
+  j->fd = fd;
+  j->head = head;
+  j->recover = buf;
+  j->recoverlen = n;
+}
+
+void editorJournalUpdate() {
+  // This function will run in the main loop. It replays a swap file found at
+  // startup once the file has loaded, and hands the journal thread its next
+  // job once the last one is done and the records waited JOURNAL_SYNC_MS.
+  journal *j = &E.journal;
+  if (j->recover && !E.loading)
+    journalReplay();
+  if (!j->running && !j->remove && !j->due)
+    return;
+  if (journalBusy())
+    // the thread writes 'j' to the wake pipe when it is done.
+    return;
+  if (j->err) {
+    editorSetStatusMessage("Can't write swap file: %s", strerror(j->err));
+    j->err = 0;
+    j->off = 1;
+    j->active = 0;
+    j->remove = 0;
+    j->due = 0;
+    j->haslast = 0;
+    return;
+  }
+  if (j->remove) {
+    j->remove = 0;
+    journalSend(JOURNAL_REMOVE);
+    return;
+  }
+  if (j->due == 0 || editorNow() < j->due)
+    return;
+
+  size_t size = j->size + j->pending.len;
+  int compact = !j->rewrite && !E.loading && !E.saving &&
+                size > JOURNAL_COMPACT_BYTES && size > 2 * j->compacted;
+  if (compact)
+    journalCompact();
+  journalSend(j->rewrite ? JOURNAL_REWRITE : JOURNAL_APPEND);
+  if (compact)
+    j->compacted = j->size;
+}
+
+int editorJournalTimeout() {
+  // This function will return how many milliseconds the main loop may sleep
+  // before the journal needs it, -1 meaning until something happens.
+  journal *j = &E.journal;
+  if (j->recover && !E.loading)
+    return 0;
+  if ((!j->remove && !j->due) || journalBusy())
+    return -1;
+  if (j->remove)
+    return 0;
+  int left = (j->due - editorNow()) * 1000 + 1;
+  return left > 0 ? left : 0;
+}
+
+void editorJournalClose() {
+  // This function will delete the swap file when the editor exits on
+  // purpose. Its edits were either saved or are being thrown away.
+  journal *j = &E.journal;
+  journalWait();
+  if (j->fd != -1) {
+    close(j->fd);
+    j->fd = -1;
+    unlink(j->path);
+  }
+}
+
+/* file input output */
+void editorOpenStream(FILE *fp) {
+  // This function will read the rows of a file that cannot be mapped (pipes,
+  // character devices, ...) line by line with getline().
+  char *line = NULL;  // line will store the line read from the file.
+  size_t linecap = 0; // linecap will store the allocated size of the line.
+  ssize_t linelen;    // linelen will store the length of the line.
+
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    // getline() will allocate memory for line and store the size of allocated
+    // memory in linecap. It will also store the length of the line in linelen.
+    while (linelen > 0 &&
+           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+      linelen--;
+    // remove the newline character from the end of the line.
+    editorInsertRowShared(E.numrows, line, linelen);
+  }
+  free(line);
+  // free the memory allocated to line.
+}
+
+long editorThreads() {
+  // This function will return how many worker threads to use, one per CPU
+  // and at most LOAD_MAX_THREADS. CEDIT_THREADS=n overrides the number, for
+  // measurements.
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  char *env = getenv("CEDIT_THREADS");
+  if (env)
+    cpus = atoi(env);
+  if (cpus > LOAD_MAX_THREADS)
+    cpus = LOAD_MAX_THREADS;
+  return cpus;
+}
+
+void editorLoadScan(int c) {
+  // This function will find the line breaks of chunk c. It runs on the worker
+  // threads and on the main thread and only touches the chunk itself.
+  load_chunk *chunk = &E.load.chunks[c];
+  size_t base = (size_t)c * LOAD_CHUNK_BYTES;
+  size_t len = E.maplen - base < LOAD_CHUNK_BYTES ? E.maplen - base
+                                                  : LOAD_CHUNK_BYTES;
+  const char *p = E.map + base;
+  size_t off = 0;
+
+  while (off < len) {
+    off += E.findbyte(p + off, len - off, '\n');
+    // E.findbyte() will find the next newline character, or return the end.
+    if (off == len)
+      break;
+    if (chunk->neol == chunk->cap) {
+      chunk->cap = chunk->cap ? chunk->cap * 2 : 4096;
+      chunk->eol = realloc(chunk->eol, sizeof(uint32_t) * chunk->cap);
+      if (chunk->eol == NULL)
+        die("realloc");
+    }
+    chunk->eol[chunk->neol++] = off;
+    off++;
+  }
+
+  madvise((char *)p, len, MADV_DONTNEED);
+  // drop the scanned pages so the resident size of the editor does not grow
+  // with the file. They are read back from the file when a row on them is
+  // drawn or edited.
+
+  pthread_mutex_lock(&E.load.lock);
+  chunk->done = 1;
+  pthread_cond_broadcast(&E.load.ready);
+  pthread_mutex_unlock(&E.load.lock);
+  write(E.wakepipe[1], "l", 1);
+}
+
+int editorLoadClaim() {
+  // This function will hand out the next chunk nobody is working on, or -1
+  // when every chunk is taken.
+  pthread_mutex_lock(&E.load.lock);
+  int c = E.load.nextchunk < E.load.nchunks ? E.load.nextchunk++ : -1;
+  pthread_mutex_unlock(&E.load.lock);
+  return c;
+}
+
+void *editorLoadWorker(void *arg) {
+  // This function will index chunks until there are none left.
+  (void)arg;
+  int c;
+  while ((c = editorLoadClaim()) != -1)
+    editorLoadScan(c);
+  return NULL;
+}
+
+int editorLoadReady() {
+  // This function will return 1 when the next chunk to be published is done.
+  // Nothing is published while search threads read the buffer.
+  if (!E.loading || E.find.running)
+    return 0;
+  pthread_mutex_lock(&E.load.lock);
+  int done = E.load.chunks[E.load.pubchunk].done;
+  pthread_mutex_unlock(&E.load.lock);
+  return done;
+}
+
+void editorLoadRow(size_t end) {
+  // This function will append the row from linestart to end to the buffer.
+  char *p = E.map + E.load.linestart;
+  size_t len = end - E.load.linestart;
+  while (len > 0 && (p[len - 1] == '\r'))
+    len--;
+  // remove the carriage return from the end of the line.
+  editorInsertRowView(E.numrows, p, len);
+  E.load.linestart = end + 1;
+}
+
+void editorLoadFinish() {
+  // This function will clean up once every chunk has become rows.
+  load_job *load = &E.load;
+  if (load->linestart < E.maplen)
+    // the last line has no line break after it.
+    editorLoadRow(E.maplen);
+
+  int j;
+  for (j = 0; j < load->nthreads; j++)
+    pthread_join(load->threads[j], NULL);
+  free(load->threads);
+  load->threads = NULL;
+  free(load->chunks);
+  load->chunks = NULL;
+  E.loading = 0;
+  madvise(E.map, E.maplen, MADV_RANDOM);
+  // from now on only the rows on screen are touched.
+  if (E.watch.follow)
+    editorWatchFollow();
+
+  editorSetStatusMessage("%d lines indexed in %.2fs on %d threads", E.numrows,
+                         editorNow() - load->start, load->nthreads + 1);
+}
+
+void editorLoadUpdate() {
+  // This function will turn the line breaks of finished chunks into rows, in
+  // file order. At most LOAD_PUBLISH_ROWS rows are added per call so the
+  // editor keeps drawing and reacting to keys while a huge file loads.
+  load_job *load = &E.load;
+  int budget = LOAD_PUBLISH_ROWS;
+
+  while (E.loading && budget > 0 && editorLoadReady()) {
+    load_chunk *chunk = &load->chunks[load->pubchunk];
+    size_t base = (size_t)load->pubchunk * LOAD_CHUNK_BYTES;
+    while (load->pubeol < chunk->neol && budget > 0) {
+      editorLoadRow(base + chunk->eol[load->pubeol++]);
+      budget--;
+    }
+    if (load->pubeol == chunk->neol) {
+      free(chunk->eol);
+      chunk->eol = NULL;
+      load->pubchunk++;
+      load->pubeol = 0;
+      if (load->pubchunk == load->nchunks)
+        editorLoadFinish();
+    }
+  }
+  if (budget < LOAD_PUBLISH_ROWS || !E.loading)
+    E.redraw = 1;
+}
+
+void editorOpen(char *filename) {
+  // This function will open the file and read the contents into the buffer.
+  // Regular files are mapped into memory and every row is a view into the
+  // mapping, so nothing is copied until a row is edited.
+  // The line breaks are found by a pool of threads working on separate
+  // chunks of the file. editorOpen() returns as soon as the first rows are
+  // there, the rest are added by the event loop while the user works.
+
+  free(E.filename);
+  E.filename = my_strdup(filename);
+  // strdup() will allocate memory for the filename and copy the filename to
+
+  int fd = open(filename, O_RDONLY); // open file in read mode.
+  if (fd == -1)
+    // if file does not exist then kill the program.
+    die("open");
+
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+    die("fstat");
+  editorJournalRecover(filename, &st);
+
+  if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+    // empty files cannot be mapped and special files have no fixed size, read
+    // them the old way instead.
+    FILE *fp = fdopen(fd, "r");
+    if (!fp)
+      die("fdopen");
+    editorOpenStream(fp);
+    fclose(fp);
+    editorJournalMapped();
+    return;
+  }
+
+  E.maplen = st.st_size;
+  E.map = mmap(NULL, E.maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  // the mapping stays valid after the file descriptor is closed.
+  if (E.map == MAP_FAILED)
+    die("mmap");
+  editorJournalMapped();
+  madvise(E.map, E.maplen, MADV_SEQUENTIAL);
+  // every chunk is scanned once from start to end to find the line breaks.
+
+  load_job *load = &E.load;
+  load->nchunks = (E.maplen + LOAD_CHUNK_BYTES - 1) / LOAD_CHUNK_BYTES;
+  load->chunks = calloc(load->nchunks, sizeof(load_chunk));
+  if (load->chunks == NULL)
+    die("calloc");
+  load->nextchunk = 1;
+  // the main thread indexes chunk 0 itself, it holds the first screen.
+  load->pubchunk = 0;
+  load->pubeol = 0;
+  load->linestart = 0;
+  load->start = editorNow();
+  E.loading = 1;
+
+  long cpus = editorThreads();
+  if (cpus > load->nchunks - 1)
+    cpus = load->nchunks - 1;
+  load->threads = malloc(sizeof(pthread_t) * (cpus > 0 ? cpus : 1));
+  load->nthreads = 0;
+  while (load->nthreads < cpus &&
+         pthread_create(&load->threads[load->nthreads], NULL, editorLoadWorker,
+                        NULL) == 0)
+    load->nthreads++;
+
+  editorLoadScan(0);
+  if (load->nthreads == 0)
+    // no threads could be started, index the whole file right here.
+    editorLoadWorker(NULL);
+
+  while (E.loading && E.numrows == 0) {
+    // wait for the first row. It usually ends in chunk 0, but a single line
+    // can span many chunks.
+    pthread_mutex_lock(&load->lock);
+    while (!load->chunks[load->pubchunk].done)
+      pthread_cond_wait(&load->ready, &load->lock);
+    pthread_mutex_unlock(&load->lock);
+    editorLoadUpdate();
+  }
+}
+
+void editorStreamRows(stream_block *b, size_t from) {
+  // This function will turn the lines of block b that end at or after byte
+  // from into rows at the end of the buffer.
+  char *data = (char *)(b + 1);
+  // the bytes of a block follow its header.
+  while (from < b->used) {
+    size_t eol = from + E.findbyte(data + from, b->used - from, '\n');
+    if (eol == b->used)
+      break;
+    size_t len = eol - b->start;
+    while (len > 0 && data[b->start + len - 1] == '\r')
+      len--;
+    // remove the carriage return from the end of the line.
+    editorInsertRowView(E.numrows, data + b->start, len);
+    b->start = eol + 1;
+    from = eol + 1;
+  }
+}
+
+stream_block *editorStreamBlock() {
+  // This function will return the block to read the pipe into, starting a
+  // new one when the newest is full. The unfinished line at the end of the
+  // full block moves to the front of the new one, which is made big enough
+  // for a long line to keep growing.
+  stream_job *st = &E.stream;
+  stream_block *old = st->tail;
+  if (old && old->used < old->size)
+    return old;
+  size_t carry = old ? old->used - old->start : 0;
+  size_t size = STREAM_BLOCK_BYTES;
+  while (size < carry * 2)
+    size *= 2;
+  stream_block *b = malloc(sizeof(stream_block) + size);
+  if (b == NULL)
+    die("malloc");
+  b->next = NULL;
+  b->size = size;
+  b->used = carry;
+  b->start = 0;
+  if (carry)
+    memcpy(b + 1, (char *)(old + 1) + old->start, carry);
+  if (old) {
+    old->used = old->start;
+    old->next = b;
+  } else {
+    st->head = b;
+  }
+  // the blocks are never freed, the rows are views into them.
+  st->tail = b;
+  return b;
+}
+
+int editorStreamWanted() {
+  // This function will return 1 when the pipe should be read from. Nothing
+  // is added to the buffer while search threads read it.
+  return E.stream.fd != -1 && !E.stream.paused && !E.find.running;
+}
+
+void editorStreamRead() {
+  // This function will read what the pipe holds, at most STREAM_TURN_BYTES of
+  // it, and add its complete lines to the buffer. The rest is read on the
+  // next turn of the event loop, after the screen was updated.
+  stream_job *st = &E.stream;
+  size_t got = 0;
+  while (st->fd != -1 && got < STREAM_TURN_BYTES) {
+    stream_block *b = editorStreamBlock();
+    size_t from = b->used;
+    ssize_t n = read(st->fd, (char *)(b + 1) + b->used, b->size - b->used);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno == EAGAIN)
+      // the pipe is empty for now.
+      break;
+    if (n <= 0) {
+      // the writer is done, or the pipe broke.
+      if (b->start < b->used) {
+        // the last line has no line break after it.
+        size_t len = b->used - b->start;
+        char *data = (char *)(b + 1);
+        while (len > 0 && data[b->start + len - 1] == '\r')
+          len--;
+        editorInsertRowView(E.numrows, data + b->start, len);
+        b->start = b->used;
+      }
+      if (n == -1)
+        editorSetStatusMessage("Can't read the pipe: %s", strerror(errno));
+      else
+        editorSetStatusMessage("%d lines read from the pipe in %.2fs",
+                               E.numrows, editorNow() - st->start);
+      close(st->fd);
+      st->fd = -1;
+      E.redraw = 1;
+      break;
+    }
+    b->used += n;
+    st->bytes += n;
+    got += n;
+    editorStreamRows(b, from);
+    if (st->bytes >= st->limit) {
+      st->paused = 1;
+      editorSetStatusMessage("Stopped reading the pipe at %zu MB "
+                             "(--stream-mb)",
+                             st->bytes >> 20);
+      break;
+    }
+  }
+  if (got) {
+    E.redraw = 1;
+    if (E.watch.follow)
+      editorWatchFollow();
+  }
+}
+
+void editorOpenPipe(int fd, int limitmb) {
+  // This function will start reading the rows of the pipe fd. The event loop
+  // reads it whenever data arrives, so the editor can be used right away.
+  stream_job *st = &E.stream;
+  st->fd = fd;
+  st->limit = (size_t)(limitmb > 0 ? limitmb : 1) * 1024 * 1024;
+  st->start = editorNow();
+  if (editorNonblock(fd) == -1)
+    die("fcntl");
+  // a blocking read would stall the event loop.
+#ifdef F_SETPIPE_SZ
+  fcntl(fd, F_SETPIPE_SZ, STREAM_PIPE_BYTES);
+  // a bigger pipe lets a fast writer hand over larger pieces. When the pipe
+  // cannot grow it keeps its size.
+#endif
+}
+
+/* paged view */
+paged_page *editorPagedPage(long long no) {
+  // This function will return page no of the paged file, reading it from the
+  // file when it is not in the cache. When the cache is full the least
+  // recently used page makes room.
+  paged_file *pg = &E.pager;
+  unsigned int h = (unsigned int)(no * 2654435761u) & pg->hashmask;
+  paged_page *page;
+
+  for (page = pg->hash[h]; page; page = page->hnext)
+    if (page->no == no)
+      break;
+
+  if (page) {
+    pg->hits++;
+    if (page == pg->mru)
+      return page;
+    // unlink the page so it can move to the front of the list.
+    page->prev->next = page->next;
+    if (page->next)
+      page->next->prev = page->prev;
+    else
+      pg->lru = page->prev;
+  } else {
+    pg->misses++;
+    if (pg->used < pg->npages) {
+      page = &pg->pages[pg->used++];
+      page->data = malloc(PAGED_PAGE_BYTES);
+      if (page->data == NULL)
+        die("malloc");
+    } else {
+      // reuse the least recently used page.
+      page = pg->lru;
+      pg->lru = page->prev;
+      if (pg->lru)
+        pg->lru->next = NULL;
+      else
+        pg->mru = NULL;
+      paged_page **pp = &pg->hash[(unsigned int)(page->no * 2654435761u) &
+                                  pg->hashmask];
+      while (*pp != page)
+        pp = &(*pp)->hnext;
+      *pp = page->hnext;
+    }
+
+    ssize_t n;
+    do
+      n = pread(pg->fd, page->data, PAGED_PAGE_BYTES, no * PAGED_PAGE_BYTES);
+    while (n == -1 && errno == EINTR);
+    page->no = no;
+    page->len = n > 0 ? n : 0;
+    page->hnext = pg->hash[h];
+    pg->hash[h] = page;
+  }
+
+  page->prev = NULL;
+  page->next = pg->mru;
+  if (pg->mru)
+    pg->mru->prev = page;
+  pg->mru = page;
+  if (pg->lru == NULL)
+    pg->lru = page;
+  return page;
+}
+
+off_t editorPagedReadLine(off_t off, char *dst, int *len) {
+  // This function will read the row starting at byte off of the paged file
+  // and return the offset of the row after it. When dst is not NULL up to
+  // PAGED_MAX_ROW bytes of the row are copied there and their number is
+  // stored in len.
+  paged_file *pg = &E.pager;
+  int n = 0;
+  while (off < pg->size) {
+    paged_page *page = editorPagedPage(off / PAGED_PAGE_BYTES);
+    size_t start = off % PAGED_PAGE_BYTES;
+    if (start >= (size_t)page->len)
+      // the file got shorter since it was indexed.
+      break;
+    size_t avail = page->len - start;
+    size_t k = E.findbyte(page->data + start, avail, '\n');
+    if (dst && n < PAGED_MAX_ROW) {
+      size_t room = PAGED_MAX_ROW - n;
+      size_t copy = k < room ? k : room;
+      memcpy(dst + n, page->data + start, copy);
+      n += copy;
+    }
+    off += k;
+    if (k < avail) {
+      off++;
+      // skip the line break.
+      break;
+    }
+    // the row goes on in the next page.
+  }
+  if (len)
+    *len = n;
+  return off < pg->size ? off : pg->size;
+}
+
+editor_row *editorPagedRow(int at) {
+  // This function will return row at of the paged file. The row is read
+  // starting from the nearest indexed row before it, or from where the last
+  // row read ended when that is closer.
+  paged_file *pg = &E.pager;
+  if (at < 0 || at >= E.numrows)
+    return NULL;
+  int slot = at % PAGED_ROW_SLOTS;
+  editor_row *row = &pg->rows[slot];
+  if (pg->rowat[slot] == at)
+    return row;
+
+  int from = at - at % PAGED_INDEX_EVERY;
+  pthread_mutex_lock(&pg->lock);
+  off_t off = pg->index[at / PAGED_INDEX_EVERY];
+  pthread_mutex_unlock(&pg->lock);
+  if (pg->nextrow > from && pg->nextrow <= at) {
+    from = pg->nextrow;
+    off = pg->nextoff;
+  }
+  while (from < at) {
+    off = editorPagedReadLine(off, NULL, NULL);
+    from++;
+  }
+
+  if (row->chars == NULL) {
+    row->chars = malloc(PAGED_MAX_ROW + 1);
+    if (row->chars == NULL)
+      die("malloc");
+  }
+  editorFreeRow(row);
+  // give back the column index of the row that was in the slot before.
+  int len = 0;
+  pg->nextoff = editorPagedReadLine(off, row->chars, &len);
+  pg->nextrow = at + 1;
+  while (len > 0 && row->chars[len - 1] == '\r')
+    len--;
+  row->chars[len] = '\0';
+  row->size = len;
+  pg->rowat[slot] = at;
+  return row;
+}
+
+void *editorPagedIndexer(void *arg) {
+  // This function will run on a thread of its own and read through the whole
+  // paged file once, noting where every PAGED_INDEX_EVERY-th row starts. It
+  // does not use the page cache so the pages on screen stay cached.
+  // When the file grew it is started again and goes on from where it ended.
+  paged_file *pg = arg;
+  char *buf = malloc(PAGED_INDEX_BLOCK);
+  off_t off = pg->scanned;
+  long long lines = pg->nlines - pg->partial;
+  off_t lastwake = off;
+  ssize_t n;
+  if (buf == NULL)
+    die("malloc");
+
+  while (off < pg->size &&
+         (n = pread(pg->fd, buf,
+                    pg->size - off < PAGED_INDEX_BLOCK ? pg->size - off
+                                                       : PAGED_INDEX_BLOCK,
+                    off)) != 0) {
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    size_t pos = 0;
+    while (1) {
+      size_t k = E.findbyte(buf + pos, n - pos, '\n');
+      if (pos + k == (size_t)n)
+        break;
+      pos += k + 1;
+      lines++;
+      if (lines % PAGED_INDEX_EVERY == 0 && lines < INT_MAX) {
+        pthread_mutex_lock(&pg->lock);
+        if (pg->nindex == pg->indexcap) {
+          pg->indexcap *= 2;
+          pg->index = realloc(pg->index, sizeof(off_t) * pg->indexcap);
+          if (pg->index == NULL)
+            die("realloc");
+        }
+        pg->index[pg->nindex++] = off + pos;
+        pthread_mutex_unlock(&pg->lock);
+      }
+    }
+    off += n;
+
+    pthread_mutex_lock(&pg->lock);
+    if (lines > pg->nlines)
+      pg->nlines = lines < INT_MAX - 1 ? lines : INT_MAX - 1;
+    // a row without a line break that was counted before stays counted.
+    pg->scanned = off;
+    pthread_cond_broadcast(&pg->ready);
+    pthread_mutex_unlock(&pg->lock);
+    if (off - lastwake >= 64 * PAGED_INDEX_BLOCK) {
+      // tell the main loop about the new rows every now and then.
+      write(E.wakepipe[1], "i", 1);
+      lastwake = off;
+    }
+  }
+  free(buf);
+
+  pthread_mutex_lock(&pg->lock);
+  pg->partial = 0;
+  if (off > 0 && lines < INT_MAX - 1) {
+    char last;
+    if (pread(pg->fd, &last, 1, off - 1) == 1 && last != '\n')
+      // the last row has no line break after it.
+      pg->partial = 1;
+  }
+  lines += pg->partial;
+  pg->nlines = lines < INT_MAX - 1 ? lines : INT_MAX - 1;
+  pg->done = 1;
+  pthread_cond_broadcast(&pg->ready);
+  pthread_mutex_unlock(&pg->lock);
+  write(E.wakepipe[1], "i", 1);
+  return NULL;
+}
+
+void editorPagedUpdate() {
+  // This function will run in the main loop when the indexer made progress
+  // and make the newly indexed rows reachable.
+  paged_file *pg = &E.pager;
+  if (!E.paged)
+    return;
+  pthread_mutex_lock(&pg->lock);
+  E.numrows = pg->nlines;
+  int done = pg->done;
+  pg->percent = pg->size ? pg->scanned * 100 / pg->size : 100;
+  pthread_mutex_unlock(&pg->lock);
+  E.redraw = 1;
+  if (E.watch.follow)
+    editorWatchFollow();
+  if (done && pg->indexing) {
+    pthread_join(pg->thread, NULL);
+    pg->indexing = 0;
+    if (pg->from == 0)
+      editorSetStatusMessage("%d lines indexed, page cache %d MB", E.numrows,
+                             (int)((long long)pg->npages * PAGED_PAGE_BYTES >>
+                                   20));
+  }
+}
+
+void editorPagedGrow(off_t size) {
+  // This function will make the rows of a paged file that grew to size bytes
+  // reachable, by indexing the new bytes only. The indexer must not be
+  // running.
+  paged_file *pg = &E.pager;
+  long long no = pg->size / PAGED_PAGE_BYTES;
+  paged_page *page;
+  for (page = pg->hash[(unsigned int)(no * 2654435761u) & pg->hashmask]; page;
+       page = page->hnext)
+    if (page->no == no) {
+      // the last page was read while the file was shorter.
+      ssize_t n = pread(pg->fd, page->data, PAGED_PAGE_BYTES,
+                        no * PAGED_PAGE_BYTES);
+      page->len = n > 0 ? n : 0;
+    }
+  int j;
+  for (j = 0; j < PAGED_ROW_SLOTS; j++)
+    pg->rowat[j] = -1;
+  pg->nextrow = 0;
+  // the last row may go on in the new bytes.
+
+  pg->from = pg->size;
+  pg->size = size;
+  pg->done = 0;
+  if (pthread_create(&pg->thread, NULL, editorPagedIndexer, pg) != 0)
+    die("pthread_create");
+  pg->indexing = 1;
+}
+
+void editorPagedClose() {
+  // This function will forget the paged file, its pages, index and rows, so
+  // another one can be opened. The indexer must not be running.
+  paged_file *pg = &E.pager;
+  int j;
+  for (j = 0; j < pg->used; j++)
+    free(pg->pages[j].data);
+  free(pg->pages);
+  free(pg->hash);
+  free(pg->index);
+  for (j = 0; j < PAGED_ROW_SLOTS; j++) {
+    editorFreeRow(&pg->rows[j]);
+    free(pg->rows[j].chars);
+    pg->rows[j].chars = NULL;
+    pg->rows[j].size = 0;
+  }
+  close(pg->fd);
+  pg->fd = -1;
+  pg->pages = NULL;
+  pg->used = 0;
+  pg->hash = NULL;
+  pg->mru = pg->lru = NULL;
+  pg->hits = pg->misses = 0;
+  pg->index = NULL;
+  pg->nindex = pg->indexcap = 0;
+  pg->nlines = pg->partial = pg->done = 0;
+  pg->scanned = pg->from = 0;
+  E.paged = 0;
+  E.numrows = 0;
+}
+
+void editorOpenPaged(char *filename, int cachemb) {
+  // This function will open a file for viewing through the page cache. Memory
+  // use is bounded by cachemb megabytes of pages plus the line index, which
+  // holds one offset per PAGED_INDEX_EVERY rows, however large the file is.
+  paged_file *pg = &E.pager;
+
+  free(E.filename);
+  E.filename = my_strdup(filename);
+  pg->fd = open(filename, O_RDONLY);
+  if (pg->fd == -1)
+    die("open");
+  struct stat st;
+  if (fstat(pg->fd, &st) == -1)
+    die("fstat");
+  pg->size = st.st_size;
+  posix_fadvise(pg->fd, 0, 0, POSIX_FADV_RANDOM);
+  // the pages are read where the user looks, not in order.
+
+  if (cachemb < 1)
+    cachemb = 1;
+  pg->npages = (long long)cachemb * 1024 * 1024 / PAGED_PAGE_BYTES;
+  pg->pages = calloc(pg->npages, sizeof(paged_page));
+  int buckets = 1;
+  while (buckets < pg->npages * 2)
+    buckets *= 2;
+  pg->hash = calloc(buckets, sizeof(paged_page *));
+  pg->hashmask = buckets - 1;
+  pg->indexcap = 1024;
+  pg->index = malloc(sizeof(off_t) * pg->indexcap);
+  if (pg->pages == NULL || pg->hash == NULL || pg->index == NULL)
+    die("calloc");
+  pg->index[0] = 0;
+  pg->nindex = 1;
+  int j;
+  for (j = 0; j < PAGED_ROW_SLOTS; j++)
+    pg->rowat[j] = -1;
+  pg->nextrow = 0;
+  pg->nextoff = 0;
+  E.paged = 1;
+
+  if (pthread_create(&pg->thread, NULL, editorPagedIndexer, pg) != 0)
+    die("pthread_create");
+  pg->indexing = 1;
+  pthread_mutex_lock(&pg->lock);
+  while (pg->scanned == 0 && !pg->done)
+    pthread_cond_wait(&pg->ready, &pg->lock);
+  // the first block of the file is enough for the first screen.
+  pthread_mutex_unlock(&pg->lock);
+  editorPagedUpdate();
+}
+
+int editorReadOnly() {
+  // This function will return 1, and say so, when the buffer may not be
+  // changed.
+  if (E.journal.recover) {
+    editorSetStatusMessage("Unsaved edits are recovered once the file loaded");
+    return 1;
+  }
+  if (!E.paged)
+    return 0;
+  editorSetStatusMessage("Paged view is read only");
+  return 1;
+}
+
+/* save */
+void editorSaveAddIov(save_job *job, char *base, size_t len) {
+  // This function will add a buffer to the list the file is written from.
+  if (job->iovcnt == job->iovcap) {
+    job->iovcap = job->iovcap ? job->iovcap * 2 : 1024;
+    job->iov = realloc(job->iov, sizeof(struct iovec) * job->iovcap);
+    if (job->iov == NULL)
+      die("realloc");
+  }
+  job->iov[job->iovcnt].iov_base = base;
+  job->iov[job->iovcnt].iov_len = len;
+  job->iovcnt++;
+}
+
+void editorSaveAddRegion(save_job *job, editor_row *row, int nl) {
+  // This function will note where in the file a row that is a view ends up,
+  // nl saying whether the line break after it in memory is written too.
+  // Views that follow each other in memory and in the file share a region.
+  size_t len = row->size + (nl ? 1 : 0);
+  journal_region *r = job->nregions ? &job->regions[job->nregions - 1] : NULL;
+  if (r && !r->nl && r->ptr + r->len == row->chars &&
+      r->off + (off_t)r->len == (off_t)job->total) {
+    r->len += len;
+    r->nl = !nl;
+    return;
+  }
+  if (len == 0)
+    // a region without bytes would only say where a line break is.
+    return;
+  if (job->nregions == job->regioncap) {
+    job->regioncap = job->regioncap ? job->regioncap * 2 : 64;
+    job->regions =
+        realloc(job->regions, sizeof(journal_region) * job->regioncap);
+    if (job->regions == NULL)
+      die("realloc");
+  }
+  r = &job->regions[job->nregions++];
+  r->ptr = row->chars;
+  r->off = job->total;
+  r->len = len;
+  r->nl = !nl;
+}
+
+int editorRowNewline(editor_row *row) {
+  // This function will return 1 when the byte right after a row that is a
+  // view is its line break, so it can be written along with the row. Only
+  // the mapping and text blocks are known to have a byte there, the
+  // addresses are compared as numbers since a row may point anywhere else.
+  if (row->owned)
+    return 0;
+  if (!row->shared) {
+    uintptr_t end = (uintptr_t)(row->chars + row->size);
+    uintptr_t map = (uintptr_t)E.map;
+    if (end < map || end >= map + E.maplen)
+      return 0;
+  }
+  return row->chars[row->size] == '\n';
+}
+
+void editorSaveAddRow(editor_row *row, void *arg) {
+  // This function will add a row and its line break to the snapshot of a save.
+  // Untouched rows that follow each other in the mapped file are merged into
+  // a single buffer together with the line breaks between them, so saving an
+  // unmodified stretch of the file costs one iovec no matter how many rows it
+  // has.
+  static char newline[] = "\n";
+  save_job *job = arg;
+  struct iovec *last = job->iovcnt ? &job->iov[job->iovcnt - 1] : NULL;
+
+  if (row->owned)
+    row->pinned = 1;
+  // the save reads the block directly, it must not change under it.
+  int nl = editorRowNewline(row);
+  // the line break right after the row can be used as is.
+  if (!row->owned && !row->shared)
+    editorSaveAddRegion(job, row, nl);
+  // text blocks may be freed, only the file's own bytes are regions.
+
+  if (!row->owned && last &&
+      (char *)last->iov_base + last->iov_len == row->chars)
+    last->iov_len += row->size;
+  else
+    editorSaveAddIov(job, row->chars, row->size);
+  last = &job->iov[job->iovcnt - 1];
+
+  if (nl)
+    last->iov_len++;
+  else
+    editorSaveAddIov(job, newline, 1);
+  job->total += row->size + 1;
+}
+
+void editorSaveUnpin(editor_row *row, void *arg) {
+  // This function will clear the pinned flag of a row.
+  (void)arg;
+  row->pinned = 0;
+}
+
+void editorSaveProgress(save_job *job, size_t written, int done, int err) {
+  // This function will publish the progress of a save and wake the main loop
+  // so it can show it.
+  pthread_mutex_lock(&job->lock);
+  job->written = written;
+  job->done = done;
+  job->err = err;
+  pthread_mutex_unlock(&job->lock);
+  write(E.wakepipe[1], "s", 1);
+}
+
+void *editorSaveWorker(void *arg) {
+  // This function will write a snapshot to disk without ever leaving a half
+  // written file behind. The rows go to a temporary file next to the original
+  // with writev(), the temporary file is flushed with fsync() and then
+  // rename()d over the original, which replaces it atomically.
+  save_job *job = arg;
+  size_t len = strlen(job->filename);
+  char *tmp = malloc(len + 8);
+  if (tmp == NULL) {
+    editorSaveProgress(job, 0, 1, ENOMEM);
+    return NULL;
+  }
+  memcpy(tmp, job->filename, len);
+  memcpy(tmp + len, ".XXXXXX", 8);
+  // mkstemp() replaces the X's with a unique name.
+
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    editorSaveProgress(job, 0, 1, errno);
+    free(tmp);
+    return NULL;
+  }
+  struct stat st;
+  if (stat(job->filename, &st) == 0)
+    fchmod(fd, st.st_mode & 07777);
+  // keep the permissions of the file being replaced.
+  else
+    fchmod(fd, 0644);
+
+  size_t written = 0;
+  double lastreport = editorNow();
+  struct iovec *iov = job->iov;
+  int left = job->iovcnt;
+  int err = 0;
+  while (left > 0) {
+    int cnt = left < IOV_MAX ? left : IOV_MAX;
+    ssize_t n = writev(fd, iov, cnt);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      err = errno;
+      break;
+    }
+    written += n;
+    while (left > 0 && (size_t)n >= iov->iov_len) {
+      // skip the buffers that were written completely.
+      n -= iov->iov_len;
+      iov++;
+      left--;
+    }
+    if (left > 0) {
+      // writev() stopped in the middle of a buffer, continue where it did.
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+    if (editorNow() - lastreport > 0.1) {
+      editorSaveProgress(job, written, 0, 0);
+      lastreport = editorNow();
+    }
+  }
+
+  if (!err && fsync(fd) == -1)
+    err = errno;
+  if (close(fd) == -1 && !err)
+    err = errno;
+  if (!err && rename(tmp, job->filename) == -1)
+    err = errno;
+  if (err)
+    unlink(tmp);
+  else
+    editorSyncDir(job->filename);
+  // flush the directory too, so the rename itself survives a crash.
+  free(tmp);
+  editorSaveProgress(job, written, 1, err);
+  return NULL;
+}
+
+void editorSaveFinish() {
+  // This function will clean up after a save and report how it went.
+  save_job *job = &E.save;
+  if (E.saving) {
+    pthread_join(E.savethread, NULL);
+    E.saving = 0;
+  }
+
+  int j;
+  for (j = 0; j < job->ndeferred; j++)
+    arenaRelease(&E.mem, job->deferred[j], job->deferredcls[j]);
+  job->ndeferred = 0;
+  textSweep();
+  bufWalk(E.root, editorSaveUnpin, NULL);
+  // the save no longer reads the rows, so they may change in place again.
+
+  double secs = editorNow() - job->start;
+  if (job->err) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+  } else {
+    E.dirty -= job->dirty;
+    // edits made while the save was running are still unsaved.
+    editorWatchStart(job->total);
+    // the file on disk is now the snapshot, a new file after the rename.
+    editorSetStatusMessage("%zu bytes written to disk (%.1f MB/s)",
+                           job->written,
+                           secs > 0 ? job->written / secs / 1e6 : 0.0);
+  }
+  editorJournalSaved(job);
+  free(job->iov);
+  job->iov = NULL;
+  job->iovcnt = 0;
+  job->iovcap = 0;
+  free(job->filename);
+  job->filename = NULL;
+}
+
+void editorSaveUpdate() {
+  // This function will run in the main loop when the saving thread reported
+  // progress.
+  save_job *job = &E.save;
+  if (!E.saving)
+    return;
+  pthread_mutex_lock(&job->lock);
+  size_t written = job->written;
+  int done = job->done;
+  pthread_mutex_unlock(&job->lock);
+
+  if (done) {
+    editorSaveFinish();
+    return;
+  }
+  double secs = editorNow() - job->start;
+  editorSetStatusMessage("Saving... %d%% (%.1f MB/s)",
+                         (int)(job->total ? written * 100 / job->total : 0),
+                         secs > 0 ? written / secs / 1e6 : 0.0);
+}
+
+void editorSave() {
+  // This function will save the buffer to its file. Small files are written
+  // right away, larger ones on a background thread so typing goes on while
+  // the file is written.
+  if (E.saving) {
+    editorSetStatusMessage("A save is already in progress");
+    return;
+  }
+  if (E.loading) {
+    editorSetStatusMessage("Can't save until the file has finished loading");
+    return;
+  }
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntax();
+  }
+
+  save_job *job = &E.save;
+  job->filename = my_strdup(E.filename);
+  job->total = 0;
+  job->iovcnt = 0;
+  job->written = 0;
+  job->done = 0;
+  job->err = 0;
+  job->dirty = E.dirty;
+  job->start = editorNow();
+  job->nregions = 0;
+  bufWalk(E.root, editorSaveAddRow, job);
+  // take the snapshot, pinning every row the save reads from the arena.
+  editorJournalSaving();
+
+  if (job->total > SAVE_BACKGROUND_BYTES &&
+      pthread_create(&E.savethread, NULL, editorSaveWorker, job) == 0) {
+    E.saving = 1;
+    editorSetStatusMessage("Saving...");
+    return;
+  }
+  editorSaveWorker(job);
+  editorSaveFinish();
+}
+
+/* find */
+void editorFindAddMatch(find_unit *u, int row, int col) {
+  // This function will record a match in the unit being searched.
+  if (u->n == u->cap) {
+    u->cap = u->cap ? u->cap * 2 : 64;
+    u->m = realloc(u->m, sizeof(find_match) * u->cap);
+    if (u->m == NULL)
+      die("realloc");
+  }
+  u->m[u->n].row = row;
+  u->m[u->n].col = col;
+  u->n++;
+}
+
+void editorFindInRow(find_unit *u, int row, const char *s, int n) {
+  // This function will record every match of the query in s, the n bytes of
+  // a row. Candidates are found by looking for the first byte of the query
+  // with E.findbyte and only they are compared in full.
+  const char *q = E.find.query;
+  int qlen = E.find.qlen;
+  int pos = 0;
+  while (pos + qlen <= n) {
+    pos += E.findbyte(s + pos, n - pos - qlen + 1, q[0]);
+    if (pos + qlen > n)
+      break;
+    if (memcmp(s + pos, q, qlen) == 0) {
+      editorFindAddMatch(u, row, pos);
+      pos += qlen;
+      // matches do not overlap.
+    } else {
+      pos++;
+    }
+  }
+}
+
+int editorFindCancelled() {
+  // This function will return 1 when the search the thread works on was
+  // cancelled.
+  return __atomic_load_n(&E.find.cancel, __ATOMIC_RELAXED);
+}
+
+void editorFindPagedUnit(find_unit *u, char *buf) {
+  // This function will search the rows of a unit of a paged file, reading
+  // them from the file into buf, which holds FIND_BLOCK bytes. Like in the
+  // paged view only the first PAGED_MAX_ROW bytes of a row are searched.
+  int fd = E.pager.fd;
+  off_t off = u->start;
+  // off is the offset in the file of buf[0].
+  size_t have = 0, p = 0;
+  int eof = 0;
+  int row = u->first, end = u->first + u->nrows;
+
+  while (row < end && !editorFindCancelled()) {
+    size_t k = p < have ? E.findbyte(buf + p, have - p, '\n') : 0;
+    if (p + k == have && !eof) {
+      // the row does not end in buf, move it to the front and read more.
+      memmove(buf, buf + p, have - p);
+      off += p;
+      have -= p;
+      p = 0;
+      if (have < FIND_BLOCK) {
+        ssize_t n = pread(fd, buf + have, FIND_BLOCK - have, off + have);
+        if (n <= 0)
+          eof = 1;
+        else
+          have += n;
+        continue;
+      }
+      // the row is longer than buf, search its start and skip the rest.
+      editorFindInRow(u, row, buf, PAGED_MAX_ROW);
+      off += have;
+      have = 0;
+      while (!eof) {
+        ssize_t n = pread(fd, buf, FIND_BLOCK, off);
+        if (n <= 0) {
+          eof = 1;
+          break;
+        }
+        size_t nl = E.findbyte(buf, n, '\n');
+        if (nl < (size_t)n) {
+          off += nl + 1;
+          break;
+        }
+        off += n;
+      }
+      row++;
+      continue;
+    }
+    if (p == have)
+      // the end of the file.
+      break;
+    size_t len = k;
+    while (len > 0 && buf[p + len - 1] == '\r')
+      len--;
+    if (len > PAGED_MAX_ROW)
+      len = PAGED_MAX_ROW;
+    editorFindInRow(u, row, buf + p, len);
+    p += k + 1;
+    row++;
+  }
+}
+
+void editorFindUnit(find_unit *u, char *buf) {
+  // This function will search the rows of one unit.
+  if (E.paged) {
+    editorFindPagedUnit(u, buf);
+    return;
+  }
+  int row = u->first;
+  int j, r;
+  for (j = u->node; j < u->node + u->nnodes; j++) {
+    buf_node *node = E.find.nodes[j];
+    if (editorFindCancelled())
+      return;
+    for (r = 0; r < node->nrows; r++, row++)
+      editorFindInRow(u, row, node->rows[r].chars, node->rows[r].size);
+  }
+}
+
+void *editorFindWorker(void *arg) {
+  // This function will search units until there are none left or the search
+  // is cancelled.
+  (void)arg;
+  find_job *job = &E.find;
+  char *buf = NULL;
+  if (E.paged && (buf = malloc(FIND_BLOCK)) == NULL)
+    die("malloc");
+  // only the rows of a paged file have to be read into a buffer.
+  while (!editorFindCancelled()) {
+    pthread_mutex_lock(&job->lock);
+    int c = job->nextunit < job->nunits ? job->nextunit++ : -1;
+    pthread_mutex_unlock(&job->lock);
+    if (c == -1)
+      break;
+    find_unit *u = &job->units[(job->startunit + c) % job->nunits];
+    editorFindUnit(u, buf);
+    if (editorFindCancelled())
+      break;
+    pthread_mutex_lock(&job->lock);
+    u->done = 1;
+    job->ndone++;
+    job->nmatches += u->n;
+    pthread_mutex_unlock(&job->lock);
+    write(E.wakepipe[1], "f", 1);
+  }
+  free(buf);
+  return NULL;
+}
+
+void editorFindStop() {
+  // This function will cancel the search threads, wait for them and forget
+  // every match.
+  find_job *job = &E.find;
+  int j;
+  __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+  for (j = 0; j < job->nthreads; j++)
+    pthread_join(job->threads[j], NULL);
+  job->nthreads = 0;
+  job->running = 0;
+  for (j = 0; j < job->nunits; j++)
+    free(job->units[j].m);
+  job->nunits = 0;
+  job->nnodes = 0;
+  job->ndone = 0;
+  job->nmatches = 0;
+  job->want = 0;
+  free(job->query);
+  job->query = NULL;
+  job->qlen = 0;
+}
+
+find_unit *editorFindNewUnit(int first) {
+  // This function will add an empty unit starting at row first.
+  find_job *job = &E.find;
+  if (job->nunits == job->unitcap) {
+    job->unitcap = job->unitcap ? job->unitcap * 2 : 64;
+    job->units = realloc(job->units, sizeof(find_unit) * job->unitcap);
+    if (job->units == NULL)
+      die("realloc");
+  }
+  find_unit *u = &job->units[job->nunits++];
+  memset(u, 0, sizeof(*u));
+  u->first = first;
+  return u;
+}
+
+int editorFindUnitOf(int row) {
+  // This function will return the unit holding row, by binary search.
+  find_job *job = &E.find;
+  int lo = 0, hi = job->nunits - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (job->units[mid].first <= row)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+void editorFindStart(const char *query) {
+  // This function will start searching the whole buffer for query. The rows
+  // are split into units that threads search in parallel. When the buffer is
+  // a single unit it is searched right here.
+  find_job *job = &E.find;
+  editorFindStop();
+  job->qlen = strlen(query);
+  if (job->qlen == 0 || E.numrows == 0)
+    return;
+  job->query = my_strdup(query);
+  job->cancel = 0;
+  job->nextunit = 0;
+
+  if (E.paged) {
+    // a paged file is split along its line index.
+    int per = FIND_UNIT_ROWS / PAGED_INDEX_EVERY;
+    int first;
+    for (first = 0; first < E.numrows; first += per * PAGED_INDEX_EVERY) {
+      find_unit *u = editorFindNewUnit(first);
+      pthread_mutex_lock(&E.pager.lock);
+      u->start = E.pager.index[first / PAGED_INDEX_EVERY];
+      pthread_mutex_unlock(&E.pager.lock);
+      u->nrows = E.numrows - first < per * PAGED_INDEX_EVERY
+                     ? E.numrows - first
+                     : per * PAGED_INDEX_EVERY;
+    }
+  } else {
+    bufCollect(E.root, &job->nodes, &job->nnodes, &job->nodecap);
+    find_unit *u = NULL;
+    int row = 0, j;
+    for (j = 0; j < job->nnodes; j++) {
+      if (u == NULL || u->nrows >= FIND_UNIT_ROWS) {
+        u = editorFindNewUnit(row);
+        u->node = j;
+      }
+      u->nnodes++;
+      u->nrows += job->nodes[j]->nrows;
+      row += job->nodes[j]->nrows;
+    }
+  }
+  job->startunit = editorFindUnitOf(E.cy < E.numrows ? E.cy : E.numrows - 1);
+
+  long cpus = editorThreads();
+  if (cpus > job->nunits)
+    cpus = job->nunits;
+  if (job->nunits == 1) {
+    editorFindWorker(NULL);
+    return;
+  }
+  job->threads = realloc(job->threads, sizeof(pthread_t) * cpus);
+  while (job->nthreads < cpus &&
+         pthread_create(&job->threads[job->nthreads], NULL, editorFindWorker,
+                        NULL) == 0)
+    job->nthreads++;
+  job->running = job->nthreads > 0;
+  if (!job->running)
+    // no thread could be started, search everything right here.
+    editorFindWorker(NULL);
+}
+
+int editorFindDone(int unit) {
+  // This function will return 1 when a unit has been searched.
+  pthread_mutex_lock(&E.find.lock);
+  int done = E.find.units[unit].done;
+  pthread_mutex_unlock(&E.find.lock);
+  return done;
+}
+
+void editorFindJump() {
+  // This function will move the cursor to the match it is waiting for, as
+  // soon as every unit between the cursor and that match is searched. The
+  // search wraps around the end or the start of the buffer.
+  find_job *job = &E.find;
+  if (!job->want || job->nunits == 0)
+    return;
+  int u0 = editorFindUnitOf(job->wantrow);
+  int i;
+  for (i = 0; i <= job->nunits; i++) {
+    int ui = ((u0 + job->dir * i) % job->nunits + job->nunits) % job->nunits;
+    if (!editorFindDone(ui))
+      // the answer may be in a unit that is still being searched.
+      return;
+    find_unit *u = &job->units[ui];
+    int k = -1, j;
+    if (job->dir > 0) {
+      for (j = 0; j < u->n && k == -1; j++)
+        if (i > 0 || u->m[j].row > job->wantrow ||
+            (u->m[j].row == job->wantrow && u->m[j].col >= job->wantcol))
+          k = j;
+    } else {
+      for (j = u->n - 1; j >= 0 && k == -1; j--)
+        if (i > 0 || u->m[j].row < job->wantrow ||
+            (u->m[j].row == job->wantrow && u->m[j].col <= job->wantcol))
+          k = j;
+    }
+    if (k != -1) {
+      E.cy = u->m[k].row;
+      E.cx = u->m[k].col;
+      job->want = 0;
+      return;
+    }
+  }
+  job->want = 0;
+  // there is no match anywhere.
+}
+
+void editorFindUpdate() {
+  // This function will run in the main loop when a search thread finished a
+  // unit.
+  find_job *job = &E.find;
+  if (job->running) {
+    pthread_mutex_lock(&job->lock);
+    int finished = job->ndone == job->nunits;
+    pthread_mutex_unlock(&job->lock);
+    if (finished) {
+      int j;
+      for (j = 0; j < job->nthreads; j++)
+        pthread_join(job->threads[j], NULL);
+      job->nthreads = 0;
+      job->running = 0;
+    }
+  }
+  editorFindJump();
+  E.redraw = 1;
+}
+
+find_match *editorFindRowMatches(int row, int *n) {
+  // This function will return the matches in a row, already found by the
+  // search, and store their number in n.
+  find_job *job = &E.find;
+  *n = 0;
+  if (!job->active || job->nunits == 0)
+    return NULL;
+  int ui = editorFindUnitOf(row);
+  if (!editorFindDone(ui))
+    return NULL;
+  find_unit *u = &job->units[ui];
+  int lo = 0, hi = u->n;
+  while (lo < hi) {
+    // find the first match in the row.
+    int mid = (lo + hi) / 2;
+    if (u->m[mid].row < row)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  int j = lo;
+  while (j < u->n && u->m[j].row == row)
+    j++;
+  *n = j - lo;
+  return *n ? &u->m[lo] : NULL;
+}
+
+void editorFindCallback(char *query, int key) {
+  // This function will run after every key typed at the search prompt. A
+  // changed query starts a new search from where the cursor was when the
+  // prompt opened, the arrow keys move to the next or previous match.
+  find_job *job = &E.find;
+  if (key == '\r' || key == '\x1b') {
+    editorFindStop();
+    job->active = 0;
+    return;
+  }
+  if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    job->dir = 1;
+    job->wantrow = E.cy;
+    job->wantcol = E.cx + 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    job->dir = -1;
+    job->wantrow = E.cy;
+    job->wantcol = E.cx - 1;
+  } else if (job->query == NULL || strcmp(query, job->query) != 0) {
+    E.cy = job->savedcy;
+    E.cx = job->savedcx;
+    editorFindStart(query);
+    job->dir = 1;
+    job->wantrow = E.cy;
+    job->wantcol = E.cx;
+  } else {
+    return;
+  }
+  job->want = job->query != NULL;
+  editorFindJump();
+}
+
+void editorFind() {
+  // This function will search the buffer as the query is typed. Escape puts
+  // the cursor back where it was, enter leaves it on the match.
+  find_job *job = &E.find;
+  job->savedcx = E.cx;
+  job->savedcy = E.cy;
+  job->savedrof = E.rof;
+  job->savedcof = E.cof;
+  job->active = 1;
+
+  char *query =
+      editorPrompt("Search: %s (ESC to cancel, arrows for previous/next)",
+                   editorFindCallback, 0);
+  if (query) {
+    free(query);
+  } else {
+    E.cx = job->savedcx;
+    E.cy = job->savedcy;
+    E.rof = job->savedrof;
+    E.cof = job->savedcof;
+  }
+}
+
+/* replace */
+void editorReplaceOut(replace_unit *u, const char *s, size_t len) {
+  // This function will append len bytes of s to the out buffer of a unit.
+  if (u->outlen + len > u->outcap) {
+    while (u->outlen + len > u->outcap)
+      u->outcap = u->outcap ? u->outcap * 2 : 4096;
+    u->out = realloc(u->out, u->outcap);
+    if (u->out == NULL)
+      die("realloc");
+  }
+  memcpy(u->out + u->outlen, s, len);
+  u->outlen += len;
+}
+
+void editorReplaceExpand(replace_unit *u, const char *with, const char *s,
+                         regmatch_t *m) {
+  // This function will append the replacement for the match m of s to the
+  // out buffer of a unit. \1 to \9 stand for the groups of the match, \0
+  // for the whole match and \\ for a backslash.
+  const char *p = with;
+  while (*p) {
+    const char *q = p;
+    while (*q && *q != '\\')
+      q++;
+    editorReplaceOut(u, p, q - p);
+    // copy the plain text up to the next backslash.
+    if (*q == '\0')
+      break;
+    if (q[1] >= '0' && q[1] <= '9') {
+      regmatch_t *g = &m[q[1] - '0'];
+      if (g->rm_so != -1)
+        editorReplaceOut(u, s + g->rm_so, g->rm_eo - g->rm_so);
+      p = q + 2;
+    } else if (q[1] != '\0') {
+      editorReplaceOut(u, q + 1, 1);
+      p = q + 2;
+    } else {
+      editorReplaceOut(u, q, 1);
+      p = q + 1;
+      // a backslash at the end stays as it is.
+    }
+  }
+}
+
+void editorReplaceRow(replace_job *job, replace_unit *u, regex_t *re,
+                      int node, int r) {
+  // This function will replace every match of the pattern in a row. When
+  // there is one, the new row is built in the out buffer of the unit and
+  // recorded, the row itself is left alone.
+  editor_row *row = &job->nodes[node]->rows[r];
+  const char *s = row->chars;
+  regoff_t n = row->size;
+  regmatch_t m[REPLACE_MAX_GROUPS];
+  regoff_t pos = 0, last = -1;
+  // last is where the previous match ended.
+  size_t start = u->outlen;
+  int found = 0;
+
+  while (pos <= n) {
+    m[0].rm_so = pos;
+    m[0].rm_eo = n;
+    // REG_STARTEND matches between these offsets, so rows that point into
+    // the mapped file need no null character.
+    if (regexec(re, s, REPLACE_MAX_GROUPS, m,
+                REG_STARTEND | (pos > 0 ? REG_NOTBOL : 0)) != 0)
+      break;
+    if (m[0].rm_so == m[0].rm_eo && m[0].rm_so == last) {
+      // an empty match right after the previous match is not one, like in
+      // sed. Step over a byte.
+      if (m[0].rm_so == n)
+        break;
+      editorReplaceOut(u, s + pos, m[0].rm_so + 1 - pos);
+      pos = m[0].rm_so + 1;
+      continue;
+    }
+    found = 1;
+    editorReplaceOut(u, s + pos, m[0].rm_so - pos);
+    editorReplaceExpand(u, job->with, s, m);
+    u->nmatches++;
+    last = m[0].rm_eo;
+    pos = m[0].rm_eo;
+    if (m[0].rm_so == m[0].rm_eo) {
+      // an empty match, keep the byte after it and move on.
+      if (pos < n)
+        editorReplaceOut(u, s + pos, 1);
+      pos++;
+    }
+  }
+  if (!found) {
+    u->outlen = start;
+    // throw away what was copied while skipping empty matches.
+    return;
+  }
+  if (pos < n)
+    editorReplaceOut(u, s + pos, n - pos);
+
+  if (u->n == u->cap) {
+    u->cap = u->cap ? u->cap * 2 : 64;
+    u->rows = realloc(u->rows, sizeof(replace_row) * u->cap);
+    if (u->rows == NULL)
+      die("realloc");
+  }
+  replace_row *rr = &u->rows[u->n++];
+  rr->node = node;
+  rr->row = r;
+  rr->off = start;
+  rr->len = u->outlen - start;
+}
+
+void *editorReplaceWorker(void *arg) {
+  // This function will handle units until there are none left. Every thread
+  // compiles the pattern for itself, glibc serialises threads that share one
+  // compiled pattern.
+  replace_job *job = arg;
+  regex_t re;
+  if (regcomp(&re, job->pattern, REG_EXTENDED) != 0)
+    return NULL;
+  // the pattern was already checked, this does not happen.
+  while (1) {
+    pthread_mutex_lock(&job->lock);
+    int c = job->nextunit < job->nunits ? job->nextunit++ : -1;
+    pthread_mutex_unlock(&job->lock);
+    if (c == -1)
+      break;
+    replace_unit *u = &job->units[c];
+    int j, r;
+    for (j = u->node; j < u->node + u->nnodes; j++)
+      for (r = 0; r < job->nodes[j]->nrows; r++)
+        editorReplaceRow(job, u, &re, j, r);
+  }
+  regfree(&re);
+  return NULL;
+}
+
+void editorReplaceAll() {
+  // This function will replace every match of a regular expression in the
+  // whole buffer. The rows are matched by one thread per CPU and the changed
+  // rows are put in the buffer at the end, in a single pass with a single
+  // redraw.
+  if (editorReadOnly())
+    return;
+  if (E.loading) {
+    editorSetStatusMessage("Can't replace until the file has finished loading");
+    return;
+  }
+  char *pattern = editorPrompt("Replace regex: %s (ESC to cancel)", NULL, 0);
+  if (pattern == NULL)
+    return;
+  regex_t re;
+  int err = regcomp(&re, pattern, REG_EXTENDED);
+  if (err != 0) {
+    char msg[64];
+    regerror(err, &re, msg, sizeof(msg));
+    editorSetStatusMessage("Bad regex: %s", msg);
+    free(pattern);
+    return;
+  }
+  regfree(&re);
+  char *with = editorPrompt("Replace with: %s (ESC to cancel, \\1 for groups)",
+                            NULL, 1);
+  if (with == NULL) {
+    free(pattern);
+    return;
+  }
+
+  double start = editorNow();
+  replace_job job;
+  memset(&job, 0, sizeof(job));
+  job.pattern = pattern;
+  job.with = with;
+  pthread_mutex_init(&job.lock, NULL);
+  bufCollect(E.root, &job.nodes, &job.nnodes, &job.nodecap);
+  int rows = 0, j, k;
+  replace_unit *u = NULL;
+  for (j = 0; j < job.nnodes; j++) {
+    // split the nodes into units of about FIND_UNIT_ROWS rows.
+    if (u == NULL || rows >= FIND_UNIT_ROWS) {
+      if (job.nunits == job.unitcap) {
+        job.unitcap = job.unitcap ? job.unitcap * 2 : 64;
+        job.units = realloc(job.units, sizeof(replace_unit) * job.unitcap);
+        if (job.units == NULL)
+          die("realloc");
+      }
+      u = &job.units[job.nunits++];
+      memset(u, 0, sizeof(*u));
+      u->node = j;
+      rows = 0;
+    }
+    u->nnodes++;
+    rows += job.nodes[j]->nrows;
+  }
+
+  long cpus = editorThreads();
+  if (cpus > job.nunits)
+    cpus = job.nunits;
+  pthread_t threads[LOAD_MAX_THREADS];
+  int nthreads = 0;
+  while (nthreads < cpus - 1 &&
+         pthread_create(&threads[nthreads], NULL, editorReplaceWorker, &job) ==
+             0)
+    nthreads++;
+  editorReplaceWorker(&job);
+  // the main thread takes units too, it waits for the others anyway.
+  for (j = 0; j < nthreads; j++)
+    pthread_join(threads[j], NULL);
+
+  size_t bytes = 0;
+  for (j = 0; j < job.nunits; j++)
+    for (k = 0; k < job.units[j].n; k++) {
+      replace_row *rr = &job.units[j].rows[k];
+      bytes += job.nodes[rr->node]->rows[rr->row].size + rr->len;
+    }
+  int undo = bytes <= E.undo.limit;
+  // a replace larger than the undo history may be cannot be undone, the
+  // history is cleared for it and only the swap file gets it.
+  if (undo)
+    undoBegin();
+  else
+    undoClear();
+
+  long long nmatches = 0;
+  int nchanged = 0;
+  int node = 0, first = 0;
+  // first is the index of the first row of job.nodes[node].
+  for (j = 0; j < job.nunits; j++) {
+    u = &job.units[j];
+    for (k = 0; k < u->n; k++) {
+      replace_row *rr = &u->rows[k];
+      editor_row *row = &job.nodes[rr->node]->rows[rr->row];
+      while (node < rr->node)
+        first += job.nodes[node++]->nrows;
+      if (undo) {
+        undoRecord(UNDO_DELETE, first + rr->row, 0, row->chars, row->size);
+        undoRecord(UNDO_INSERT, first + rr->row, 0, u->out + rr->off,
+                   rr->len);
+        // the old and the new row are all undo needs.
+      } else {
+        journalRecord(JOURNAL_DELETE, first + rr->row, 0, NULL, row->size);
+        journalRecord(JOURNAL_INSERT, first + rr->row, 0, u->out + rr->off,
+                      rr->len);
+      }
+      editorRowSetChars(row, u->out + rr->off, rr->len);
+      editorHlChanged(first + rr->row);
+    }
+    nmatches += u->nmatches;
+    nchanged += u->n;
+    free(u->out);
+    free(u->rows);
+  }
+  free(job.units);
+  free(job.nodes);
+  pthread_mutex_destroy(&job.lock);
+  free(pattern);
+  free(with);
+
+  if (nchanged) {
+    E.dirty++;
+    // the whole replace is one edit.
+    if (E.cy < E.numrows && E.cx > bufRow(E.cy)->size)
+      E.cx = bufRow(E.cy)->size;
+  }
+  double secs = editorNow() - start;
+  editorSetStatusMessage("Replaced %lld matches in %d rows, %.0f rows/s%s",
+                         nmatches, nchanged,
+                         secs > 0 ? E.numrows / secs : (double)E.numrows,
+                         undo && !undoDropped() ? "" : ", too large to undo");
+}
+
+/* filter */
+// Ctrl-P pipes a range of lines, or the whole buffer, through a shell command
+// and puts what the command prints in their place, like ! in vi. The rows go
+// to the command with writev() straight from the mapping and the arena, and
+// its output is read at the same time through non-blocking pipes, so neither
+// side waits on a full pipe. Every line of output becomes a row in a text
+// block as soon as it arrives. The old rows go, and the undo records are
+// made, only once the command succeeded.
+
+void editorFilterFill(filter_job *f) {
+  // This function will gather the next rows to send into f->iov. Rows that
+  // follow each other in memory with their line breaks are sent as one
+  // buffer, like a save does.
+  static char newline[] = "\n";
+  f->iovat = 0;
+  f->iovcnt = 0;
+  while (f->next <= f->last && f->iovcnt < IOV_MAX - 1) {
+    editor_row *row = bufRow(f->next++);
+    f->bytes += row->size + 1;
+    int nl = editorRowNewline(row);
+    struct iovec *last = f->iovcnt ? &f->iov[f->iovcnt - 1] : NULL;
+    if (last && (char *)last->iov_base + last->iov_len == row->chars) {
+      last->iov_len += row->size;
+    } else {
+      f->iov[f->iovcnt].iov_base = row->chars;
+      f->iov[f->iovcnt].iov_len = row->size;
+      last = &f->iov[f->iovcnt++];
+    }
+    if (nl) {
+      last->iov_len++;
+    } else {
+      f->iov[f->iovcnt].iov_base = newline;
+      f->iov[f->iovcnt].iov_len = 1;
+      f->iovcnt++;
+    }
+  }
+}
+
+void editorFilterWrite(filter_job *f) {
+  // This function will send the command as many rows as the pipe takes, and
+  // close the pipe once all of them are sent. A command that stops reading
+  // early, like head, just gets no more.
+  while (f->in != -1) {
+    if (f->iovat == f->iovcnt) {
+      editorFilterFill(f);
+      if (f->iovcnt == 0) {
+        close(f->in);
+        f->in = -1;
+        return;
+      }
+    }
+    ssize_t n = writev(f->in, &f->iov[f->iovat], f->iovcnt - f->iovat);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno == EAGAIN)
+      return;
+    if (n == -1) {
+      close(f->in);
+      f->in = -1;
+      return;
+    }
+    while (n > 0 && (size_t)n >= f->iov[f->iovat].iov_len)
+      n -= f->iov[f->iovat++].iov_len;
+    if (n > 0) {
+      f->iov[f->iovat].iov_base = (char *)f->iov[f->iovat].iov_base + n;
+      f->iov[f->iovat].iov_len -= n;
+    }
+  }
+}
+
+void editorFilterRow(filter_job *f, const char *s, size_t len) {
+  // This function will make a line of output a row.
+  while (len > 0 && s[len - 1] == '\r')
+    len--;
+  editorInsertRowShared(f->at++, s, len);
+  f->rows++;
+  f->bytes += len + 1;
+}
+
+void editorFilterRead(filter_job *f) {
+  // This function will read what the command printed and turn its whole
+  // lines into rows. The unfinished line moves to the front of the buffer,
+  // which only grows for a line longer than it.
+  while (f->out != -1) {
+    if (f->len == f->cap) {
+      f->cap = f->cap ? f->cap * 2 : FILTER_CHUNK_BYTES;
+      f->buf = realloc(f->buf, f->cap);
+      if (f->buf == NULL)
+        die("realloc");
+    }
+    ssize_t n = read(f->out, f->buf + f->len, f->cap - f->len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && errno == EAGAIN)
+      return;
+    if (n <= 0) {
+      // the command is done.
+      if (f->len)
+        // the last line has no line break after it.
+        editorFilterRow(f, f->buf, f->len);
+      f->len = 0;
+      close(f->out);
+      f->out = -1;
+      return;
+    }
+    size_t start = 0, from = f->len;
+    f->len += n;
+    while (from < f->len) {
+      size_t eol = from + E.findbyte(f->buf + from, f->len - from, '\n');
+      if (eol == f->len)
+        break;
+      editorFilterRow(f, f->buf + start, eol - start);
+      start = from = eol + 1;
+    }
+    memmove(f->buf, f->buf + start, f->len - start);
+    f->len -= start;
+  }
+}
+
+int editorFilterCancelled() {
+  // This function will return 1 when Ctrl-C was typed while a command runs.
+  // The other keys stay where they are and are handled afterwards.
+  editorFillInput();
+  unsigned int i;
+  for (i = 0; i < E.inhead - E.intail; i++)
+    if (editorPeekInput(i) == CTRL_KEY('c'))
+      return 1;
+  return 0;
+}
+
+void editorFilterRecord(int type, int row, int col, const char *s, size_t len,
+                        int undo) {
+  // This function will record an edit of a filter in the undo log, or only
+  // in the swap file when undo is not set.
+  if (undo)
+    undoRecord(type, row, col, s, len);
+  else
+    journalRecord(type == UNDO_INSERT   ? JOURNAL_INSERT
+                  : type == UNDO_DELETE ? JOURNAL_DELETE
+                                        : JOURNAL_ADD_ROW,
+                  row, col, s, len);
+}
+
+void editorFilterRecordRows(int type, int first, int n, int undo) {
+  // This function will record the edit that inserts the n rows from first,
+  // each with a line break in front, or the one that deletes n rows at first,
+  // each with a line break after. Rows are put together into records of
+  // about FILTER_UNDO_BYTES.
+  if (!undo && !journalOn())
+    return;
+  struct abuf piece = {NULL, 0, 0};
+  int start = first, k;
+  for (k = 0; k < n; k++) {
+    editor_row *row = bufRow(first + k);
+    if (type == UNDO_INSERT)
+      abAppend(&piece, "\n", 1);
+    abAppend(&piece, row->chars, row->size);
+    if (type == UNDO_DELETE)
+      abAppend(&piece, "\n", 1);
+    if (piece.len >= FILTER_UNDO_BYTES || k == n - 1) {
+      if (type == UNDO_INSERT)
+        editorFilterRecord(UNDO_INSERT, start - 1, bufRow(start - 1)->size,
+                           piece.b, piece.len, undo);
+      else
+        editorFilterRecord(UNDO_DELETE, first, 0, piece.b, piece.len, undo);
+      start = first + k + 1;
+      piece.len = 0;
+    }
+  }
+  free(piece.b);
+}
+
+int editorFilterReplace(int first, int last, int n, size_t bytes) {
+  // This function will put the n rows of output after row last in place of
+  // the rows from first to last, and record it as one edit. bytes is the
+  // size of the old and the new rows. An edit larger than the undo history
+  // may be cannot be undone, the history is cleared for it and 0 returned.
+  int k;
+  int undo = bytes <= E.undo.limit;
+  if (undo)
+    undoBegin();
+  else
+    undoClear();
+  k = 0;
+  if (last < first && n > 0) {
+    // the buffer was empty, the first row of output is a row of its own.
+    editorFilterRecord(UNDO_ADD_ROW, 0, 0, NULL, 0, undo);
+    editorFilterRecord(UNDO_INSERT, 0, 0, bufRow(0)->chars, bufRow(0)->size,
+                       undo);
+    k = 1;
+  }
+  editorFilterRecordRows(UNDO_INSERT, last + 1 + k, n - k, undo);
+
+  int follow = last + 1 < E.numrows;
+  // follow is set when a row comes after the old ones, output or not.
+  int gone = last - first + 1 - (follow ? 0 : 1);
+  editorFilterRecordRows(UNDO_DELETE, first, gone, undo);
+  for (k = 0; k < gone; k++)
+    editorDelRow(first);
+  if (!follow && last >= first) {
+    // the old rows were the end of the buffer and nothing replaces them, the
+    // line break before them goes instead.
+    editor_row *row = bufRow(first);
+    editorFilterRecord(UNDO_DELETE, first, 0, row->chars, row->size, undo);
+    if (first > 0) {
+      editorFilterRecord(UNDO_DELETE, first - 1, bufRow(first - 1)->size,
+                         "\n", 1, undo);
+      editorDelRow(first);
+    } else {
+      editorRowSetChars(row, "", 0);
+      editorHlChanged(first);
+    }
+  }
+  return undo;
+}
+
+void editorFilter() {
+  // This function will ask for a command and pipe rows through it. A range
+  // of lines like 10-20 in front of the command picks the rows, otherwise
+  // the whole buffer goes. The output replaces the rows only when the
+  // command exits with 0, Ctrl-C stops it.
+  if (editorReadOnly())
+    return;
+  if (E.loading || E.stream.fd != -1) {
+    editorSetStatusMessage("Can't filter until the file has finished loading");
+    return;
+  }
+  char *arg = editorPrompt("Filter through: %s (10-20 cmd for a range, ESC to "
+                           "cancel)",
+                           NULL, 0);
+  if (arg == NULL)
+    return;
+  long first = 1, last = E.numrows;
+  int skip = 0;
+  char *cmd = arg;
+  if (sscanf(arg, "%ld-%ld %n", &first, &last, &skip) == 2 && skip) {
+    cmd = arg + skip;
+    if (first < 1 || last < first || first > E.numrows) {
+      editorSetStatusMessage("No lines %ld-%ld", first, last);
+      free(arg);
+      return;
+    }
+    if (last > E.numrows)
+      last = E.numrows;
+  }
+  first--;
+  last--;
+  // first and last are row indexes from here on.
+
+  double start = editorNow();
+  int in[2] = {-1, -1}, out[2] = {-1, -1};
+  filter_job f;
+  memset(&f, 0, sizeof(f));
+  if (pipe2(in, O_CLOEXEC) == -1 || pipe2(out, O_CLOEXEC) == -1 ||
+      editorNonblock(in[1]) == -1 || editorNonblock(out[0]) == -1 ||
+      (f.pid = fork()) == -1) {
+    // running out of descriptors or processes is no reason to lose the
+    // edits, the buffer stays as it is.
+    int err = errno;
+    if (in[0] != -1) {
+      close(in[0]);
+      close(in[1]);
+    }
+    if (out[0] != -1) {
+      close(out[0]);
+      close(out[1]);
+    }
+    // pipe2() opens both ends or neither.
+    editorSetStatusMessage("Can't run filter: %s", strerror(err));
+    free(arg);
+    return;
+  }
+  if (f.pid == 0) {
+    // the command reads the rows and prints to the pipe back, its error
+    // messages too.
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(out[1], STDERR_FILENO);
+    // nothing else the editor has open is the command's business, the swap
+    // file and the file being read least of all.
+    int fd = -1;
+#ifdef CLOSE_RANGE_CLOEXEC
+    fd = close_range(3, ~0U, 0);
+#endif
+    if (fd == -1) {
+      struct rlimit rl;
+      if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur > INT_MAX)
+        rl.rlim_cur = 1024;
+      for (fd = 3; fd < (int)rl.rlim_cur; fd++)
+        close(fd);
+    }
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  f.in = in[1];
+  f.out = out[0];
+  f.next = first;
+  f.last = last;
+  f.at = last + 1;
+  f.iov = malloc(sizeof(struct iovec) * IOV_MAX);
+  if (f.iov == NULL)
+    die("malloc");
+  struct sigaction ign, old;
+  memset(&ign, 0, sizeof(ign));
+  ign.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &ign, &old);
+  // a command that exits before it read everything must not end the editor.
+
+  int cancelled = 0;
+  while (f.out != -1 && !cancelled) {
+    struct pollfd fds[3];
+    int n = 0, j;
+    if (f.in != -1) {
+      fds[n].fd = f.in;
+      fds[n++].events = POLLOUT;
+    }
+    fds[n].fd = f.out;
+    fds[n++].events = POLLIN;
+    if (!E.headless && E.inhead - E.intail < INPUT_RING_SIZE) {
+      // keys are read only to look for Ctrl-C, while there is room for them.
+      fds[n].fd = E.infd;
+      fds[n++].events = POLLIN;
+    }
+    if (poll(fds, n, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      die("poll");
+    }
+    for (j = 0; j < n; j++) {
+      if (!fds[j].revents)
+        continue;
+      if (fds[j].fd == f.in)
+        editorFilterWrite(&f);
+      else if (fds[j].fd == f.out)
+        editorFilterRead(&f);
+      else
+        cancelled = editorFilterCancelled();
+    }
+  }
+  if (cancelled)
+    kill(f.pid, SIGTERM);
+  if (f.in != -1)
+    close(f.in);
+  if (f.out != -1)
+    close(f.out);
+  int status;
+  while (waitpid(f.pid, &status, 0) == -1 && errno == EINTR)
+    ;
+  sigaction(SIGPIPE, &old, NULL);
+  free(f.iov);
+  free(f.buf);
+
+  int k;
+  if (cancelled || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    char msg[64] = "";
+    if (f.rows > 0)
+      snprintf(msg, sizeof(msg), ": %.*s", bufRow(last + 1)->size,
+               bufRow(last + 1)->chars);
+    // the first line of output is usually the error message.
+    for (k = 0; k < f.rows; k++)
+      editorDelRow(last + 1);
+    if (cancelled)
+      editorSetStatusMessage("Filter cancelled");
+    else if (WIFEXITED(status))
+      editorSetStatusMessage("%.20s exited with %d%s", cmd,
+                             WEXITSTATUS(status), msg);
+    else
+      editorSetStatusMessage("%.20s was killed by signal %d", cmd,
+                             WTERMSIG(status));
+  } else {
+    while (f.next <= last)
+      // rows the command did not read.
+      f.bytes += bufRow(f.next++)->size + 1;
+    int undo = editorFilterReplace(first, last, f.rows, f.bytes);
+    E.dirty++;
+    E.cy = first < E.numrows ? first : 0;
+    E.cx = 0;
+    editorSetStatusMessage("%ld lines filtered into %d in %.2fs%s",
+                           last - first + 1, f.rows, editorNow() - start,
+                           undo && !undoDropped() ? "" : ", too large to undo");
+  }
+  free(arg);
+  E.redraw = 1;
+}
+
+/* file watch */
+void editorWatchReadTail(int fd) {
+  // This function will remember the last bytes the buffer holds of the file
+  // fd, and whether they end in a line break.
+  file_watch *w = &E.watch;
+  off_t at = w->size > WATCH_TAIL_BYTES ? w->size - WATCH_TAIL_BYTES : 0;
+  ssize_t n = pread(fd, w->tail, w->size - at, at);
+  w->taillen = n > 0 ? n : 0;
+  w->open = w->taillen > 0 && w->tail[w->taillen - 1] != '\n';
+}
+
+int editorWatchSameTail(int fd) {
+  // This function will return 1 when the file fd still has the bytes the
+  // buffer ends with where they were.
+  file_watch *w = &E.watch;
+  char buf[WATCH_TAIL_BYTES];
+  if (w->taillen == 0)
+    return 1;
+  return pread(fd, buf, w->taillen, w->size - w->taillen) == w->taillen &&
+         memcmp(buf, w->tail, w->taillen) == 0;
+}
+
+void editorWatchStart(off_t size) {
+  // This function will watch the file the buffer holds the first size bytes
+  // of. Its directory is watched as well, so a new file put in its place, as
+  // a log rotation does, is noticed too.
+  file_watch *w = &E.watch;
+  struct stat st;
+  if (w->fd == -1 || E.filename == NULL || E.stream.fd != -1)
+    return;
+  // the rows still coming from a pipe are not in a file.
+  int fd = open(E.filename, O_RDONLY);
+  if (fd == -1)
+    return;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+    // only a regular file can be read again, a pipe is gone once read.
+    close(fd);
+    return;
+  }
+
+  int wd = inotify_add_watch(w->fd, E.filename,
+                             IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                                 IN_DELETE_SELF);
+  if (w->wd != -1 && w->wd != wd)
+    inotify_rm_watch(w->fd, w->wd);
+  w->wd = wd;
+  char *dir = my_strdup(E.filename);
+  int dirwd = inotify_add_watch(w->fd, dirname(dir), IN_CREATE | IN_MOVED_TO);
+  free(dir);
+  if (w->dirwd != -1 && w->dirwd != dirwd)
+    inotify_rm_watch(w->fd, w->dirwd);
+  w->dirwd = dirwd;
+
+  w->dev = st.st_dev;
+  w->ino = st.st_ino;
+  w->size = size;
+  editorWatchReadTail(fd);
+  close(fd);
+  w->stale = 0;
+  w->pending = 1;
+  // the file may have changed before the watch was there.
+}
+
+int editorWatchBusy() {
+  // This function will return 1 while the buffer cannot take rows from the
+  // file: it is still loading, being saved or searched, the search prompt
+  // shows matches in it, or edits from a swap file are still to be replayed.
+  return E.loading || E.saving || E.find.running || E.find.active ||
+         E.pager.indexing || E.journal.recover;
+}
+
+void editorWatchFollow() {
+  // This function will put the cursor on the last row, so the screen shows
+  // the end of the file.
+  E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+  E.cx = 0;
+  E.redraw = 1;
+}
+
+void editorWatchAppend(int fd, off_t size) {
+  // This function will add the bytes the file fd got after the ones the
+  // buffer holds as rows at its end, up to size and at most
+  // WATCH_APPEND_BYTES of them. The rows are not edits, the buffer still is
+  // what the file holds.
+  file_watch *w = &E.watch;
+  size_t len = size - w->size < WATCH_APPEND_BYTES ? size - w->size
+                                                   : WATCH_APPEND_BYTES;
+  char *buf = malloc(len);
+  if (buf == NULL)
+    die("malloc");
+  ssize_t n = pread(fd, buf, len, w->size);
+  if (n <= 0) {
+    free(buf);
+    return;
+  }
 
-  free(row->render);
-  // free the memory allocated to the render string.
-  row->render = malloc(row->size + tabs * (CEDIT_TAB_STOP - 1) + 1);
-  // allocate memory for the render string.
-
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    // loop through the row and copy the characters to the render string.
-    if (row->chars[j] == '\t') {
-      // if the character is a tab then copy 7 spaces to the render string.
-      row->render[idx++] = ' ';
-      while (idx % CEDIT_TAB_STOP != 0)
-        row->render[idx++] = ' ';
+  size_t start = 0;
+  while (start < (size_t)n) {
+    size_t end = start + E.findbyte(&buf[start], n - start, '\n');
+    // end is the position of the next line break, or n.
+    int broken = end < (size_t)n;
+    size_t piece = end - start;
+    if (broken)
+      while (piece > 0 && buf[start + piece - 1] == '\r')
+        piece--;
+    // remove the carriage return from the end of the line.
+    if (w->open && E.numrows > 0) {
+      // the last row had no line break yet, the new bytes go on with it.
+      editor_row *row = bufRow(E.numrows - 1);
+      editorRowAppendString(row, &buf[start], piece);
+      if (broken && row->size > 0 && row->chars[row->size - 1] == '\r')
+        editorRowDelChar(row, row->size - 1);
+      editorHlChanged(E.numrows - 1);
     } else {
-      row->render[idx++] = row->chars[j];
+      editorInsertRowShared(E.numrows, &buf[start], piece);
     }
+    w->open = !broken;
+    start = end + 1;
   }
-  row->render[idx] = '\0';
-  // add the null character at the end of the render string.
-  row->rsize = idx;
-}
-
-void editorAppendRow(char *s, size_t len) {
-  // This function will append a row to the end of the row array.
+  free(buf);
 
-  E.row = realloc(E.row, sizeof(editor_row) * (E.numrows + 1));
-  // realloc() will allocate memory for the new row and copy the old rows to
-  // the new memory location. The size of the new row is the size of the
-  // editor_row struct multiplied by the number of rows plus one.
+  w->size += n;
+  editorWatchReadTail(fd);
+  if (w->size < size)
+    // the rest is read on the next turn of the event loop.
+    w->pending = 1;
+  if (w->follow)
+    editorWatchFollow();
+  E.redraw = 1;
+}
 
-  int at = E.numrows;
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  // malloc() will allocate memory for the characters in the row.
-  // The size of the memory allocated is the length of the string plus one for
-  // the null character.
+void editorWatchReload() {
+  // This function will read the file again from the start, after it was
+  // rewritten or replaced. The rows, their lexer states and the undo
+  // history all belonged to the old contents and go.
+  char *filename = my_strdup(E.filename);
+  int cy = E.cy;
+  editorFindStop();
+  if (E.paged) {
+    int cachemb = (long long)E.pager.npages * PAGED_PAGE_BYTES >> 20;
+    editorPagedClose();
+    editorOpenPaged(filename, cachemb);
+  } else {
+    bufFree();
+    if (E.map)
+      munmap(E.map, E.maplen);
+    E.map = NULL;
+    E.maplen = 0;
+    editorOpen(filename);
+  }
+  free(filename);
+  undoClear();
+  editorHlReset();
+  editorWatchStart(E.paged ? E.pager.size : (off_t)E.maplen);
+  // a replaced file has a new inode to watch.
 
-  memcpy(E.row[at].chars, s, len);
-  // memcpy() will copy the string to the memory allocated.
+  E.cy = cy < E.numrows ? cy : (E.numrows > 0 ? E.numrows - 1 : 0);
+  E.cx = 0;
+  if (E.watch.follow)
+    editorWatchFollow();
+  E.framevalid = 0;
+  E.redraw = 1;
+  editorSetStatusMessage("%.20s changed on disk and was read again",
+                         E.filename);
+}
 
-  E.row[at].chars[len] = '\0';
-  // The last character of the string is set to null character.
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  editorUpdateRow(&E.row[at]);
+void editorWatchUpdate() {
+  // This function will run in the main loop when inotify reported that the
+  // file changed, or when a change had to wait, and bring the buffer up to
+  // date. The events only say that something happened, the file itself says
+  // what: when it only grew, just the new bytes are read, otherwise all of
+  // it is.
+  file_watch *w = &E.watch;
+  char buf[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  const char *base = E.filename ? strrchr(E.filename, '/') : NULL;
+  base = base ? base + 1 : E.filename;
+  ssize_t n;
+  while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+    char *p = buf;
+    while (p < buf + n) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->wd == w->wd && (ev->mask & IN_IGNORED))
+        // the file was deleted and took its watch along.
+        w->wd = -1;
+      if (ev->wd != w->dirwd || (ev->len && strcmp(ev->name, base) == 0))
+        // of the files in the directory only the one open matters.
+        w->pending = 1;
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+  if (w->stale || E.filename == NULL)
+    w->pending = 0;
+  if (!w->pending)
+    return;
+  if (editorWatchBusy())
+    // editorTimeout() brings the editor back here soon.
+    return;
+  w->pending = 0;
 
-  E.numrows++;
-  // Increment the number of rows.
+  int fd = open(E.filename, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    if (fd != -1)
+      close(fd);
+    // a log rotation moves the file away before it makes a new one.
+    return;
+  }
+  int rewritten = st.st_dev != w->dev || st.st_ino != w->ino ||
+                  st.st_size < w->size || !editorWatchSameTail(fd);
+  if (!rewritten && st.st_size == w->size) {
+    // only the time stamps or the permissions changed.
+    close(fd);
+    return;
+  }
+  if (E.dirty) {
+    // the edits would be lost, the file is left to the next save.
+    w->stale = 1;
+    editorSetStatusMessage("%.20s changed on disk, Ctrl-S overwrites it",
+                           E.filename);
+    E.redraw = 1;
+    close(fd);
+    return;
+  }
+  if (rewritten) {
+    close(fd);
+    editorWatchReload();
+    return;
+  }
+  if (E.paged) {
+    editorPagedGrow(st.st_size);
+    w->size = st.st_size;
+    editorWatchReadTail(fd);
+  } else {
+    editorWatchAppend(fd, st.st_size);
+  }
+  close(fd);
 }
 
-void editorRowInsertChar(editor_row *row, int at, int c) {
-  // This function will insert a character at a given position in the row.
-  if (at < 0 || at > row->size)
-    // If the position is less than 0 or greater than the size of the row
-    // then set the position to the size of the row.
-    at = row->size;
-
-  row->chars = realloc(row->chars, row->size + 2);
-  // size is plus 2 because we are adding a character and a null character.
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  // memmove() will move the characters after the position at by one position
-  // to the right.
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
+/* stats */
+void editorStatsFrame() {
+  // This function will close the sample of the frame just written. It goes
+  // in the window the summary is taken over, and in the CSV file when there
+  // is one.
+  editor_stats *st = &E.stats;
+  frame_stats *f = &st->cur;
+  st->last[st->frames % STATS_WINDOW] = *f;
+  st->frames++;
+  if (st->csv)
+    fprintf(st->csv, "%ld,%.6f,%.1f,%.1f,%.1f,%ld,%ld,%ld,%ld\n", st->frames,
+            editorNow() - st->start, f->keys * 1e6, f->draw * 1e6,
+            f->write * 1e6, f->drawn, f->sent, f->bytes, f->allocs);
+  memset(f, 0, sizeof(*f));
 }
 
-/* editor functions */
-void editorInsertChar(int c) {
-  // This function will insert a character at the cursor position.
-  if (E.cy == E.numrows) {
-    // If the cursor is at the end of the file then append a new row.
-    editorAppendRow("", 0);
+void editorStatsSummary(char *buf, size_t size) {
+  // This function will write the average of the last STATS_WINDOW frames to
+  // buf, for the message bar.
+  editor_stats *st = &E.stats;
+  long n = st->frames < STATS_WINDOW ? st->frames : STATS_WINDOW;
+  frame_stats sum;
+  memset(&sum, 0, sizeof(sum));
+  long j;
+  for (j = 0; j < n; j++) {
+    frame_stats *f = &st->last[j];
+    sum.keys += f->keys;
+    sum.draw += f->draw;
+    sum.write += f->write;
+    sum.drawn += f->drawn;
+    sum.sent += f->sent;
+    sum.bytes += f->bytes;
+    sum.allocs += f->allocs;
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  // Insert the character at the cursor position.
-  E.cx++;
+  if (n == 0)
+    n = 1;
+  snprintf(buf, size,
+           "%ld frames: keys %.0fus draw %.0fus write %.0fus | rows %ld/%ld "
+           "%ldB %ld allocs | %ld skipped",
+           st->frames, sum.keys * 1e6 / n, sum.draw * 1e6 / n,
+           sum.write * 1e6 / n, sum.drawn / n, sum.sent / n, sum.bytes / n,
+           sum.allocs / n, E.out.skipped);
 }
 
-/* file input output */
-void editorOpen(char *filename) {
-  // This function will open the file and read the contents into the buffer.
-
-  free(E.filename);
-  E.filename = my_strdup(filename);
-  // strdup() will allocate memory for the filename and copy the filename to
-
-  FILE *fp = fopen(filename, "r"); // open file in read mode.
-  if (!fp)
-    // if file does not exist then kill the program.
-    die("fopen");
+/* buffer */
+void abAppend(struct abuf *ab, const char *s, int len) {
+  // This function will append a string to the append buffer. The buffer
+  // doubles when it is full, so a buffer that is reused for every frame
+  // soon stops growing at all.
+  if (ab->len + len > ab->cap) {
+    int cap = ab->cap ? ab->cap : ABUF_MIN;
+    while (cap < ab->len + len)
+      cap *= 2;
+    char *new = realloc(ab->b, cap);
+    // realloc() will allocate a new block of memory and copy the contents of
+    // the old block to the new block.
+    if (new == NULL)
+      return;
+    ab->b = new;
+    ab->cap = cap;
+  }
+  memcpy(&ab->b[ab->len], s, len);
+  // memcpy() copies len bytes from memory area s to the end of the buffer.
+  ab->len += len;
+}
 
-  char *line = NULL;  // line will store the line read from the file.
-  size_t linecap = 0; // linecap will store the allocated size of the line.
-  ssize_t linelen;    // linelen will store the length of the line.
+/* output thread */
+void *editorOutputWorker(void *arg) {
+  // This function will run on a thread of its own and write every frame it
+  // is handed to the terminal. A slow terminal only holds up this thread,
+  // the keys go on being read and handled meanwhile.
+  output_job *out = arg;
+  pthread_mutex_lock(&out->lock);
+  while (1) {
+    while (!out->busy)
+      pthread_cond_wait(&out->cond, &out->lock);
+    pthread_mutex_unlock(&out->lock);
 
-  linelen = getline(&line, &linecap, fp);
-  //  read the first line getline() will allocate memory for line and store
-  //  the size of allocated memory in linecap.It will also store the length of
-  //  the line in linelen.
+    double start = editorNow();
+    editorWriteAll(out->sending.b, out->sending.len);
 
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    // read the rest of the lines.
-    while (linelen > 0 &&
-           (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-      linelen--;
-    // remove the newline character from the end of the line.
-    editorAppendRow(line, linelen);
+    pthread_mutex_lock(&out->lock);
+    out->writetime += editorNow() - start;
+    out->busy = 0;
+    pthread_cond_broadcast(&out->cond);
+    write(E.wakepipe[1], "o", 1);
   }
-  free(line);
-  fclose(fp);
-  // free the memory allocated to line and close the file.
+  return NULL;
 }
 
-/* buffer */
-struct abuf {
-  // This is a structure that contains the append buffer.
-  char *b;
-  int len;
-};
+void editorOutputStart() {
+  // This function will start the output thread. Without it every frame is
+  // written by the main thread, as a headless run does so each key gets a
+  // frame of its own.
+  output_job *out = &E.out;
+  if (pthread_create(&out->thread, NULL, editorOutputWorker, out) == 0)
+    out->running = 1;
+}
 
-#define ABUF_INIT                                                              \
-  { NULL, 0 }
-// This macro will initialize the append buffer.
+int editorOutputBusy() {
+  // This function will return 1 while the last frame is still being written.
+  output_job *out = &E.out;
+  if (!out->running)
+    return 0;
+  pthread_mutex_lock(&out->lock);
+  int busy = out->busy;
+  pthread_mutex_unlock(&out->lock);
+  return busy;
+}
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-  // This function will append a string to the append buffer.
-  char *new = realloc(ab->b, ab->len + len);
-  // realloc() will allocate a new block of memory and copy the contents of
-  // the old block to the new block.
-  if (new == NULL)
-    return;
-  memcpy(&new[ab->len], s, len);
-  // memcpy() copies len bytes from memory area s to memory area new.
-  ab->b = new;
-  ab->len += len;
+void editorOutputFlush() {
+  // This function will wait until the frame being written has reached the
+  // terminal.
+  output_job *out = &E.out;
+  if (!out->running || pthread_equal(pthread_self(), out->thread))
+    return;
+  pthread_mutex_lock(&out->lock);
+  while (out->busy)
+    pthread_cond_wait(&out->cond, &out->lock);
+  pthread_mutex_unlock(&out->lock);
 }
 
-void abFree(struct abuf *ab) {
-  // This function will free the append buffer.
-  free(ab->b);
+void editorOutputSend(struct abuf *ab) {
+  // This function will hand the frame in ab to the output thread, or write
+  // it right away when there is none. The output thread gets the buffer and
+  // ab gets the one the thread wrote last, so both are reused frame after
+  // frame.
+  output_job *out = &E.out;
+  if (!out->running) {
+    editorWriteAll(ab->b, ab->len);
+    return;
+  }
+  pthread_mutex_lock(&out->lock);
+  struct abuf sent = out->sending;
+  out->sending = *ab;
+  *ab = sent;
+  out->busy = 1;
+  STATS_COUNT(write, out->writetime);
+  // the frames before took that long to write.
+  out->writetime = 0;
+  pthread_cond_broadcast(&out->cond);
+  pthread_mutex_unlock(&out->lock);
 }
 
 /* Output functions */
@@ -403,8 +6773,8 @@ void editorScroll() {
   // This function will scroll the screen if the cursor is outside the screen.
   E.rx = 0;
   if (E.cy < E.numrows) {
-    // if the cursor is on a row then calculate the render index of the cursor.
-    E.rx = editorRowCxtoRx(&E.row[E.cy], E.cx);
+    // if the cursor is on a row then calculate the screen column of the cursor.
+    E.rx = editorRowCxtoRx(bufRow(E.cy), E.cx);
   }
   if (E.cy < E.rof) {
     // If the cursor is above the screen then scroll up.
@@ -421,12 +6791,169 @@ void editorScroll() {
     // If the cursor is to the right of the screen then scroll right.
     E.cof = E.rx - E.screencols + 1;
 }
+uint64_t editorHashLine(const char *s, int len) {
+  // This function will return the FNV-1a hash of a screen line.
+  uint64_t h = 14695981039346656037ULL;
+  int j;
+  for (j = 0; j < len; j++) {
+    h ^= (unsigned char)s[j];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void editorEmitLine(struct abuf *ab, int y, struct abuf *line) {
+  // This function will send screen line y to the terminal, but only when it
+  // differs from what the last frame put there.
+  uint64_t h = editorHashLine(line->b, line->len);
+  if (E.framevalid && E.frame[y] == h)
+    return;
+  E.frame[y] = h;
+  STATS_COUNT(sent, 1);
+
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+  // move the cursor to the start of the line.
+  abAppend(ab, buf, len);
+  abAppend(ab, line->b, line->len);
+  abAppend(ab, "\x1b[K", 3);
+  // This will clear the rest of the line.
+}
+
+void editorScrollFrame(struct abuf *ab) {
+  // This function will scroll the lines already on the terminal when the view
+  // moved up or down by less than a screen, so only the rows that scrolled
+  // into view have to be drawn.
+  int delta = E.rof - E.framerof;
+  int y;
+  if (!E.framevalid || !E.canscroll || delta == 0 || E.cof != E.framecof)
+    return;
+  if (delta >= E.screenrows || -delta >= E.screenrows)
+    return;
+
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr", E.screenrows);
+  // limit scrolling to the text area, leaving the two bars alone.
+  abAppend(ab, buf, len);
+  if (delta > 0) {
+    len = snprintf(buf, sizeof(buf), "\x1b[%dS", delta);
+    // S scrolls the region up, the new rows appear at the bottom.
+    memmove(&E.frame[0], &E.frame[delta],
+            sizeof(uint64_t) * (E.screenrows - delta));
+    for (y = E.screenrows - delta; y < E.screenrows; y++)
+      E.frame[y] = 0;
+  } else {
+    len = snprintf(buf, sizeof(buf), "\x1b[%dT", -delta);
+    // T scrolls the region down, the new rows appear at the top.
+    memmove(&E.frame[-delta], &E.frame[0],
+            sizeof(uint64_t) * (E.screenrows + delta));
+    for (y = 0; y < -delta; y++)
+      E.frame[y] = 0;
+  }
+  abAppend(ab, buf, len);
+  abAppend(ab, "\x1b[r", 3);
+  // reset the scroll region to the whole screen.
+}
+
+void editorDrawRow(struct abuf *line, editor_row *row, int at) {
+  // This function will draw the part of row at between columns cof and
+  // cof + screencols. Only the characters in that window are looked at, the
+  // column index of the row finds the first one, so drawing a huge row costs
+  // no more than drawing a short one. Tabs become spaces, control characters
+  // are shown as ^X and bytes that are not UTF-8 as ?, both in inverse video.
+  // Matches of the search and the syntax of the row are highlighted.
+  int end = E.cof + E.screencols;
+  int cx = editorRowRxtoCx(row, E.cof);
+  int rx = editorRowCxtoRx(row, cx);
+  // the character at cx may start left of the screen, a tab or a wide
+  // character cut by the edge.
+  int len;
+  int nm, mi = 0, color = HL_NORMAL;
+  find_match *m = editorFindRowMatches(at, &nm);
+  // color is the highlight the terminal is drawing with.
+  int hlend = editorRowRxtoCx(row, end) + 4;
+  if (hlend > row->size)
+    hlend = row->size;
+  unsigned char *hl = editorHlRow(row, at, hlend);
+  // the syntax highlight of the row up to the right edge of the screen.
+  if (hl == NULL)
+    hlend = 0;
+
+  while (cx < row->size && rx < end) {
+    while (mi < nm && m[mi].col + E.find.qlen <= cx)
+      mi++;
+    int inmatch = mi < nm && m[mi].col <= cx;
+    int want = inmatch ? HL_MATCH : cx < hlend ? hl[cx] : HL_NORMAL;
+    if (want != color) {
+      if (color != HL_NORMAL)
+        abAppend(line, "\x1b[m", 3);
+      const char *seq = editorHlColor(want);
+      abAppend(line, seq, strlen(seq));
+      color = want;
+    }
+    int stop = mi == nm ? row->size
+               : inmatch ? m[mi].col + E.find.qlen
+                         : m[mi].col;
+    if (!inmatch && cx < hlend) {
+      int s = cx + 1;
+      while (s < stop && s < hlend && hl[s] == want)
+        s++;
+      stop = s;
+    }
+    // stop is where the colour changes next.
+
+    unsigned char c = row->chars[cx];
+    if (c >= 0x20 && c < 0x7f && rx >= E.cof) {
+      // copy a run of plain ASCII in one go.
+      int n = 1;
+      while (cx + n < stop && rx + n < end &&
+             (unsigned char)row->chars[cx + n] >= 0x20 &&
+             (unsigned char)row->chars[cx + n] < 0x7f)
+        n++;
+      abAppend(line, &row->chars[cx], n);
+      cx += n;
+      rx += n;
+      continue;
+    }
+
+    int w = editorCharWidth(&row->chars[cx], row->size - cx, rx, &len);
+    if (c == '\t' || rx < E.cof) {
+      // tabs and what is left of a character cut by the left edge are blank.
+      int from = rx < E.cof ? E.cof : rx;
+      int to = rx + w < end ? rx + w : end;
+      while (from++ < to)
+        abAppend(line, " ", 1);
+    } else if (rx + w > end) {
+      // a wide character that does not fit is left out.
+      break;
+    } else if (c < 0x20 || c == 0x7f) {
+      char sym[2] = {'^', c == 0x7f ? '?' : c + '@'};
+      abAppend(line, "\x1b[7m", 4);
+      abAppend(line, sym, 2);
+      abAppend(line, "\x1b[m", 3);
+      color = HL_NORMAL;
+    } else if (len == 1 && c >= 0x80) {
+      abAppend(line, "\x1b[7m?\x1b[m", 8);
+      color = HL_NORMAL;
+    } else {
+      abAppend(line, &row->chars[cx], len);
+    }
+    rx += w;
+    cx += len;
+  }
+  if (color != HL_NORMAL)
+    abAppend(line, "\x1b[m", 3);
+}
+
 void editorDrawRows(struct abuf *ab) {
   // This function will draw the rows of the editor.
   int y;
+  struct abuf *line = &E.out.line;
+  // line collects one screen line before it is compared with the last frame.
 
   for (y = 0; y < E.screenrows; y++) {
     int filerow = y + E.rof;
+    line->len = 0;
     if (filerow >= E.numrows) {
       // If the number of rows is less than the number of rows in the terminal
       // then print ~.
@@ -444,100 +6971,152 @@ void editorDrawRows(struct abuf *ab) {
           welcomelen = E.screencols;
         int padding = (E.screencols - welcomelen) / 2;
         if (padding) {
-          abAppend(ab, "~", 1);
+          abAppend(line, "~", 1);
           padding--;
         }
         while (padding--)
-          abAppend(ab, " ", 1);
-        abAppend(ab, welcome, welcomelen);
+          abAppend(line, " ", 1);
+        abAppend(line, welcome, welcomelen);
         // abAppend() appends a string to the append buffer.
       } else {
-        abAppend(ab, "~", 1);
+        abAppend(line, "~", 1);
       }
     } else {
-      int len = E.row[filerow].rsize - E.cof;
-      // len is the length of the row.
-      if (len < 0)
-        len = 0;
-      if (len > E.screencols)
-        len = E.screencols;
-      abAppend(ab, &E.row[filerow].render[E.cof], len);
-      // abAppend() appends a string to the append buffer.
+      editorDrawRow(line, bufRow(filerow), filerow);
+      STATS_COUNT(drawn, 1);
     }
 
-    abAppend(ab, "\x1b[K", 3);
-    // This will clear the line after the ~ character.
-    abAppend(ab, "\r\n", 2);
-    // This will move the cursor to the next line.
+    editorEmitLine(ab, y, line);
   }
 }
 
 void editorDrawStatusBar(struct abuf *ab) {
   // This function will draw the status bar.
-  abAppend(ab, "\x1b[7m", 4);
+  struct abuf *line = &E.out.line;
+  line->len = 0;
+  abAppend(line, "\x1b[7m", 4);
   // This will set the background color of the status bar.
 
-  char status[80], rst[20];
+  char status[120], rst[40], loading[32] = "", found[48] = "";
   // status will store the status of the editor.
   // rst will store the reset sequence.
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines",
-                     E.filename ? E.filename : "[No Name]", E.numrows);
+  if (E.loading)
+    snprintf(loading, sizeof(loading), " (loading %d%%)",
+             (int)(E.load.linestart * 100 / E.maplen));
+  else if (E.pager.indexing)
+    snprintf(loading, sizeof(loading), " (paged, indexing %d%%)",
+             E.pager.percent);
+  else if (E.paged)
+    snprintf(loading, sizeof(loading), " (paged)");
+  else if (E.stream.fd != -1)
+    snprintf(loading, sizeof(loading),
+             E.stream.paused ? " (pipe paused, %zu MB)" : " (pipe, %zu MB)",
+             E.stream.bytes >> 20);
+  // the line count keeps going up while a big file is indexed.
+  if (E.find.active && E.find.query) {
+    pthread_mutex_lock(&E.find.lock);
+    long long matches = E.find.nmatches;
+    int percent = E.find.ndone * 100 / E.find.nunits;
+    pthread_mutex_unlock(&E.find.lock);
+    if (percent < 100)
+      snprintf(found, sizeof(found), " [%lld matches, searched %d%%]", matches,
+               percent);
+    else
+      snprintf(found, sizeof(found), " [%lld matches]", matches);
+  }
+  int len = snprintf(status, sizeof(status), "%.20s - %d lines%s%s%s %s",
+                     E.filename ? E.filename : "[No Name]", E.numrows, loading,
+                     found, E.watch.follow ? " (follow)" : "",
+                     E.dirty ? "(modified)" : "");
   // print the status of the editor.
-  int rlen = snprintf(rst, sizeof(rst), "%d:%d/%d", E.rx, E.cy + 1, E.numrows);
-  // print the reset sequence.
+  int rlen = snprintf(rst, sizeof(rst), "%s | %dB %d:%d/%d",
+                      E.hl.syntax ? E.hl.syntax->filetype : "no ft",
+                      E.framebytes, E.rx, E.cy + 1, E.numrows);
+  // print the reset sequence, led by the bytes written for the last frame.
 
   if (len > E.screencols)
     len = E.screencols;
-  abAppend(ab, status, len);
+  abAppend(line, status, len);
 
   while (len < E.screencols) {
     if (E.screencols - len == rlen) {
-      abAppend(ab, rst, rlen);
+      abAppend(line, rst, rlen);
       break;
     } else {
-      abAppend(ab, " ", 1);
+      abAppend(line, " ", 1);
       len++;
     }
   }
-  abAppend(ab, "\x1b[m",
+  abAppend(line, "\x1b[m",
            3); // This will reset the background color of the status bar.
-  abAppend(ab, "\r\n", 2); // This will move the cursor to the next line.
+  editorEmitLine(ab, E.screenrows, line);
 }
 
 void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+  // This function will draw the message bar below the status bar.
+  struct abuf *line = &E.out.line;
+  line->len = 0;
   int msglen = strlen(E.statusmsg);
   if (msglen > E.screencols)
     msglen = E.screencols;
-  if (msglen && time(NULL) - E.statusmsg_time < 5)
-    abAppend(ab, E.statusmsg, msglen);
+  if (E.stats.show) {
+    // the stats summary takes the place of the message.
+    char summary[160];
+    editorStatsSummary(summary, sizeof(summary));
+    msglen = strlen(summary);
+    abAppend(line, summary, msglen > E.screencols ? E.screencols : msglen);
+  } else if (msglen && time(NULL) - E.statusmsg_time < STATUS_MSG_SECONDS)
+    abAppend(line, E.statusmsg, msglen);
+  editorEmitLine(ab, E.screenrows + 1, line);
 }
 
 void editorRefreshScreen() {
-  // This function will clear the screen and draw the welcome message.
+  // This function will bring the terminal up to date with the editor. Only
+  // the lines that changed since the last frame are sent.
+  if (editorOutputBusy()) {
+    // the terminal has not taken the last frame yet. This one is skipped,
+    // the event loop draws a new one as soon as the output thread is done.
+    E.out.deferred = 1;
+    E.out.skipped++;
+    return;
+  }
+  E.out.deferred = 0;
 
+  STATS_START(t);
   editorScroll();
-  struct abuf ab = ABUF_INIT;
+  struct abuf *ab = &E.out.frame;
+  ab->len = 0;
 
-  abAppend(&ab, "\x1b[?25l", 6);
+  abAppend(ab, "\x1b[?25l", 6);
   // This will hide the cursor.
-  abAppend(&ab, "\x1b[H", 3);
-  // \x1b is the escape character. [H is the escape sequence that moves the
-  // cursor to the top left corner of the screen.
+  if (E.clearscreen) {
+    abAppend(ab, "\x1b[2J", 4);
+    // the window changed size, start from an empty screen.
+    E.clearscreen = 0;
+  }
 
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
+  editorScrollFrame(ab);
+  editorDrawRows(ab);
+  editorDrawStatusBar(ab);
+  editorDrawMessageBar(ab);
+  E.framevalid = 1;
+  E.framerof = E.rof;
+  E.framecof = E.cof;
 
   char buf[32];
   snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rof + 1, E.rx - E.cof + 1);
   // This will move the cursor to the position of the cursor.
-  abAppend(&ab, buf, strlen(buf));
+  abAppend(ab, buf, strlen(buf));
   // This will move the cursor to the position of the cursor.
-  abAppend(&ab, "\x1b[?25h", 6);
+  abAppend(ab, "\x1b[?25h", 6);
   // This will show the cursor.
-  write(STDOUT_FILENO, ab.b, ab.len);
-  abFree(&ab);
+  STATS_TIME(draw, t);
+  STATS_COUNT(bytes, ab->len);
+  E.framebytes = ab->len;
+  STATS_START(w);
+  editorOutputSend(ab);
+  STATS_TIME(write, w);
+  STATS_FRAME();
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -555,26 +7134,95 @@ void editorSetStatusMessage(const char *fmt, ...) {
   // time() returns the current time.
 }
 /* input functions */
+char *editorPrompt(char *prompt, void (*callback)(char *, int),
+                   int allowempty) {
+  // This function will ask for a line of text in the message bar. prompt must
+  // contain a %s where the text typed so far goes. It returns the text, or
+  // NULL when the prompt was cancelled with escape. callback, when not NULL,
+  // is called with the text and the key after every key. Enter only accepts
+  // an empty answer when allowempty is set.
+  size_t bufsize = 128;
+  char *buf = malloc(bufsize);
+  size_t buflen = 0;
+  buf[0] = '\0';
+
+  while (1) {
+    editorSetStatusMessage(prompt, buf);
+    editorRefreshScreen();
+    E.redraw = 0;
+    while (E.nkeys == 0 && !E.redraw)
+      editorWaitEvent();
+    if (E.nkeys == 0)
+      // something other than a key changed the screen, a search result for
+      // example.
+      continue;
+
+    int c = editorReadKey();
+    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+      if (buflen != 0)
+        buf[--buflen] = '\0';
+    } else if (c == '\x1b') {
+      editorSetStatusMessage("");
+      if (callback)
+        callback(buf, c);
+      free(buf);
+      return NULL;
+    } else if (c == '\r') {
+      if (buflen != 0 || allowempty) {
+        editorSetStatusMessage("");
+        if (callback)
+          callback(buf, c);
+        return buf;
+      }
+    } else if ((c >= 32 && c < 127) || (c >= 128 && c < 256)) {
+      // printable ASCII and the bytes of UTF-8 characters.
+      if (buflen == bufsize - 1) {
+        bufsize *= 2;
+        buf = realloc(buf, bufsize);
+      }
+      buf[buflen++] = c;
+      buf[buflen] = '\0';
+    }
+    if (callback)
+      callback(buf, c);
+  }
+}
+
+int editorLastRow() {
+  // This function will return the last row the cursor may go to. That is
+  // normally the empty row after the end of the file, but while the file is
+  // still loading the rows after the last one are not there yet and typing
+  // there would put text in the middle of the file.
+  // A paged file cannot be typed into, so it has no row after its end either,
+  // and a pipe that is still being read is like a file still loading.
+  int last =
+      E.loading || E.paged || E.stream.fd != -1 ? E.numrows - 1 : E.numrows;
+  return last > 0 ? last : 0;
+}
+
 void editorMoveCursor(int key) {
   // This function will move the cursor.
-  editor_row *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  editor_row *row = (E.cy >= E.numrows) ? NULL : bufRow(E.cy);
   // if position of cursor is greater than the number of rows in the file then
   // row will be NULL otherwise it will point to the row of the cursor.
+  int rx = -1;
+  // rx is the screen column kept when moving up or down.
 
   switch (key) {
   case ARROW_LEFT:
     if (E.cx != 0) {
-      E.cx--;
+      E.cx = editorRowPrevCx(row, E.cx);
+      // a UTF-8 character is stepped over as a whole.
     } else if (E.cy > 0) {
       // move to the end of the previous line.
       E.cy--;
-      E.cx = E.row[E.cy].size;
+      E.cx = bufRow(E.cy)->size;
     }
     break;
   case ARROW_RIGHT:
     if (row && E.cx < row->size) {
-      E.cx++;
-    } else if (row && E.cx == row->size) {
+      E.cx = editorRowNextCx(row, E.cx);
+    } else if (row && E.cx == row->size && E.cy < editorLastRow()) {
       // move to the start of the next line.
       E.cy++;
       E.cx = 0;
@@ -582,19 +7230,25 @@ void editorMoveCursor(int key) {
     break;
   case ARROW_UP:
     if (E.cy != 0) {
+      rx = row ? editorRowCxtoRx(row, E.cx) : 0;
       E.cy--;
     }
     break;
   case ARROW_DOWN:
-    if (E.cy != E.numrows) {
+    if (E.cy < editorLastRow()) {
       // if we are not at the last row of the file, move the cursor down.
+      rx = row ? editorRowCxtoRx(row, E.cx) : 0;
       E.cy++;
     }
     break;
   }
 
-  row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+  row = (E.cy >= E.numrows) ? NULL : bufRow(E.cy);
   // same as first check in function
+  if (row && rx >= 0)
+    // land on the character drawn in the same column, never in the middle of
+    // a tab or a UTF-8 sequence.
+    E.cx = editorRowRxtoCx(row, rx);
   int rowlen = row ? row->size : 0;
   // if row is NULL then rowlen will be 0 otherwise it will be the size of the
   // row.
@@ -604,23 +7258,238 @@ void editorMoveCursor(int key) {
     E.cx = rowlen;
 }
 
-void editorProcessKeypress() {
-  // This function will read a key from the terminal and process it.
-  int c = editorReadKey();
+/* keyboard macros */
+// Ctrl-K starts recording the keys that edit or move the cursor and Ctrl-K
+// again stops. Ctrl-G replays them a number of times, or once for every line
+// of a range with the cursor put at the start of the line first. A replay
+// runs the keys straight through editorProcessKey(), so nothing is drawn
+// until it is done, rows are highlighted again only when they are drawn,
+// and the whole replay is one undo step.
+
+int editorMacroRecords(int c) {
+  // This function will return 1 for the keys a macro keeps. Commands that
+  // ask for input, save, quit, undo or replay are run but not recorded.
+  switch (c) {
+  case CTRL_KEY('q'):
+  case CTRL_KEY('s'):
+  case CTRL_KEY('f'):
+  case CTRL_KEY('r'):
+  case CTRL_KEY('p'):
+  case CTRL_KEY('e'):
+  case CTRL_KEY('t'):
+  case CTRL_KEY('z'):
+  case CTRL_KEY('y'):
+  case CTRL_KEY('k'):
+  case CTRL_KEY('g'):
+  case CTRL_KEY('l'):
+  case '\x1b':
+    return 0;
+  }
+  return 1;
+}
+
+void editorMacroAdd(int c) {
+  // This function will add a key to the macro being recorded, and the text
+  // of a paste.
+  macro *m = &E.macro;
+  if (m->nkeys + 2 > m->cap) {
+    m->cap = m->cap ? m->cap * 2 : 64;
+    m->keys = realloc(m->keys, sizeof(int) * m->cap);
+    if (m->keys == NULL)
+      die("realloc");
+  }
+  m->keys[m->nkeys++] = c;
+  if (c != PASTE_KEY)
+    return;
+  m->keys[m->nkeys++] = E.pastelen;
+  if (m->textlen + E.pastelen > m->textcap) {
+    while (m->textlen + E.pastelen > m->textcap)
+      m->textcap = m->textcap ? m->textcap * 2 : 4096;
+    m->text = realloc(m->text, m->textcap);
+    if (m->text == NULL)
+      die("realloc");
+  }
+  memcpy(m->text + m->textlen, E.paste, E.pastelen);
+  m->textlen += E.pastelen;
+}
+
+void editorMacroRecord() {
+  // This function will start recording a macro, or stop when one is being
+  // recorded. A new recording replaces the old macro.
+  macro *m = &E.macro;
+  if (m->recording) {
+    m->recording = 0;
+    editorSetStatusMessage("Macro of %d keys recorded, Ctrl-G replays it",
+                           m->nkeys);
+    return;
+  }
+  m->nkeys = 0;
+  m->textlen = 0;
+  m->recording = 1;
+  editorSetStatusMessage("Recording a macro, Ctrl-K stops");
+}
+
+void editorMacroRun() {
+  // This function will run the keys of the macro once.
+  macro *m = &E.macro;
+  size_t text = 0;
+  int j;
+  for (j = 0; j < m->nkeys; j++) {
+    int c = m->keys[j];
+    if (c != PASTE_KEY) {
+      editorProcessKey(c);
+      continue;
+    }
+    // the recorded text stands in for the paste buffer. No input is read
+    // during a replay, so nothing else uses the buffer meanwhile.
+    char *paste = E.paste;
+    size_t pastelen = E.pastelen;
+    E.paste = m->text + text;
+    E.pastelen = m->keys[++j];
+    editorProcessKey(c);
+    text += E.pastelen;
+    E.paste = paste;
+    E.pastelen = pastelen;
+  }
+}
+
+void editorMacroPlay() {
+  // This function will ask how often to replay the macro and replay it. The
+  // answer is a count, or a range of lines like 10-2000. Each line of a
+  // range is where the line after the last one was, once the rows the macro
+  // added or deleted are taken into account.
+  macro *m = &E.macro;
+  if (m->recording)
+    editorMacroRecord();
+  if (m->nkeys == 0) {
+    editorSetStatusMessage("No macro, Ctrl-K records one");
+    return;
+  }
+  char *arg = editorPrompt("Replay macro: %s (count or lines a-b, ESC to "
+                           "cancel)",
+                           NULL, 1);
+  if (arg == NULL)
+    return;
+  long times = 1, first = 0, last = 0;
+  int range = sscanf(arg, "%ld-%ld", &first, &last) == 2;
+  int ok = range ? first >= 1 && last >= first
+                 : arg[0] == '\0' || (sscanf(arg, "%ld", &times) == 1 &&
+                                      times >= 1);
+  free(arg);
+  if (!ok) {
+    editorSetStatusMessage("Give a count or a range of lines like 10-20");
+    return;
+  }
+
+  double start = editorNow();
+  long n = 0;
+  undoBegin();
+  m->playing = 1;
+  if (range) {
+    long row = first - 1;
+    while (n < last - first + 1 && row < E.numrows) {
+      int rows = E.numrows;
+      E.cy = row;
+      E.cx = 0;
+      editorMacroRun();
+      n++;
+      row += 1 + E.numrows - rows;
+    }
+  } else {
+    for (; n < times; n++)
+      editorMacroRun();
+  }
+  m->playing = 0;
+  E.undo.merge = 0;
+  editorSetStatusMessage("Macro replayed %ld times in %.3fs%s", n,
+                         editorNow() - start,
+                         undoDropped() ? ", too large to undo" : "");
+}
+
+void editorProcessKey(int c) {
+  // This function will process one key.
+  if (E.macro.recording && editorMacroRecords(c))
+    editorMacroAdd(c);
+  int merge = E.undo.merge;
+  E.undo.merge = 0;
+  // only characters typed one after the other share an undo record.
   switch (c) {
   case CTRL_KEY('q'):
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
+    if (E.saving)
+      editorSaveFinish();
+    // let a background save finish before exiting.
+    editorJournalClose();
+    if (E.headless)
+      editorReplayFinish();
+    editorWrite("\x1b[2J", 4);
+    editorWrite("\x1b[H", 3);
     // Clear the screen before exiting
     exit(0);
     break;
 
+  case CTRL_KEY('s'):
+    if (!editorReadOnly())
+      editorSave();
+    break;
+
+  case CTRL_KEY('f'):
+    editorFind();
+    break;
+
+  case CTRL_KEY('r'):
+    editorReplaceAll();
+    break;
+
+  case CTRL_KEY('p'):
+    editorFilter();
+    break;
+
+  case CTRL_KEY('e'):
+    E.watch.follow = !E.watch.follow;
+    if (E.watch.follow)
+      editorWatchFollow();
+    editorSetStatusMessage(E.watch.follow ? "Following the end of the file"
+                                          : "Stopped following the file");
+    break;
+
+  case CTRL_KEY('t'):
+    if (!CEDIT_STATS)
+      editorSetStatusMessage("Stats were compiled out (CEDIT_STATS=0)");
+    E.stats.show = CEDIT_STATS && !E.stats.show;
+    break;
+
+  case CTRL_KEY('k'):
+    editorMacroRecord();
+    break;
+  case CTRL_KEY('g'):
+    editorMacroPlay();
+    break;
+
+  case CTRL_KEY('z'):
+    if (!editorReadOnly())
+      editorUndo();
+    break;
+  case CTRL_KEY('y'):
+    if (!editorReadOnly())
+      editorRedo();
+    break;
+
   case HOME_KEY:
     E.cx = 0;
     break;
+  case FILE_HOME:
+    E.cy = 0;
+    E.cx = 0;
+    break;
+  case FILE_END:
+    // the last row is looked up directly, none of the rows before it are
+    // touched.
+    E.cy = editorLastRow();
+    E.cx = 0;
+    break;
   case END_KEY:
     if (E.cy < E.numrows)
-      E.cx = E.row[E.cy].size;
+      E.cx = bufRow(E.cy)->size;
     break;
 
   case PAGE_DOWN:
@@ -631,8 +7500,8 @@ void editorProcessKeypress() {
     } else if (c == PAGE_DOWN) {
       // move the cursor to the bottom of the screen.
       E.cy = E.rof + E.screenrows - 1;
-      if (E.cy > E.numrows)
-        E.cy = E.numrows;
+      if (E.cy > editorLastRow())
+        E.cy = editorLastRow();
     }
     int times = E.screenrows;
     while (times--)
@@ -645,8 +7514,275 @@ void editorProcessKeypress() {
   case ARROW_DOWN:
     editorMoveCursor(c);
     break;
+
+  case '\r':
+    if (!editorReadOnly())
+      editorInsertNewline();
+    break;
+  case BACKSPACE:
+  case CTRL_KEY('h'):
+  case DEL_KEY:
+    if (editorReadOnly())
+      break;
+    if (c == DEL_KEY)
+      // delete removes the character under the cursor instead.
+      editorMoveCursor(ARROW_RIGHT);
+    editorDelChar();
+    break;
+
+  case PASTE_KEY:
+    if (!editorReadOnly())
+      editorInsertText(E.paste, E.pastelen);
+    break;
+
+  case CTRL_KEY('l'):
+  case '\x1b':
+    break;
   default:
-    editorInsertChar(c);
+    E.undo.merge = merge;
+    if (!editorReadOnly())
+      editorInsertChar(c);
+  }
+}
+
+void editorProcessKeypress() {
+  // This function will process every key that already arrived, so the screen
+  // is only redrawn once for a whole burst of input.
+  STATS_START(t);
+  while (E.nkeys > 0) {
+    editorProcessKey(editorReadKey());
+    if (E.nkeys == 0)
+      editorDecodeInput(0);
+  }
+  STATS_TIME(keys, t);
+}
+
+/* event loop */
+void editorHandleSigwinch(int sig) {
+  // This function will run when the terminal window changes size. Only a byte
+  // is written to the self-pipe, the work is done by the event loop.
+  (void)sig;
+  int saved = errno;
+  write(E.wakepipe[1], "w", 1);
+  errno = saved;
+}
+
+void editorResize() {
+  // This function will pick up the new window size and make sure the next
+  // frame redraws everything.
+  if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+    die("getWindowSize");
+  E.screenrows -= 2;
+  free(E.frame);
+  E.frame = calloc(E.screenrows + 2, sizeof(uint64_t));
+  E.framevalid = 0;
+  E.clearscreen = 1;
+  E.redraw = 1;
+}
+
+int editorTimeout() {
+  // This function will return how long poll() may sleep in milliseconds, -1
+  // meaning until something happens.
+  if (E.inhead != E.intail && !E.inpaste)
+    // an escape sequence is waiting for the rest of its bytes.
+    return ESC_TIMEOUT_MS;
+  if (editorLoadReady())
+    // indexed rows are waiting to be added to the buffer.
+    return 0;
+  if (E.watch.pending)
+    // the file changed, look again as soon as the buffer is free.
+    return editorWatchBusy() ? WATCH_RETRY_MS : 0;
+  int journal = editorJournalTimeout();
+  if (journal != -1)
+    // edits are waiting to go to the swap file.
+    return journal;
+  if (E.statusmsg[0]) {
+    time_t left = E.statusmsg_time + STATUS_MSG_SECONDS - time(NULL);
+    if (left > 0)
+      // wake up when the status message has to disappear.
+      return left * 1000;
+  }
+  return -1;
+}
+
+void editorWaitEvent() {
+  // This function will sleep in poll() until input arrives, the window is
+  // resized or a timer runs out, and then handle what woke it up. An idle
+  // editor spends all its time in here without using the CPU.
+  struct pollfd fds[4];
+  if (E.headless && E.inputeof && E.nkeys == 0 &&
+      (E.inhead == E.intail || E.inpaste))
+    // the script is used up, there is nothing left to wait for.
+    editorReplayFinish();
+  fds[0].fd = E.infd;
+  fds[0].events = POLLIN;
+  // poll() skips a negative fd, a headless run has none until the file is
+  // loaded.
+  fds[1].fd = E.wakepipe[0];
+  fds[1].events = POLLIN;
+  fds[2].fd = E.watch.fd;
+  fds[2].events = POLLIN;
+  // inotify says when the open file changes on disk.
+  fds[3].fd = editorStreamWanted() ? E.stream.fd : -1;
+  fds[3].events = POLLIN;
+  // a pipe that is not read from fills up and makes its writer wait.
+
+  int timeout = editorTimeout();
+  int n = poll(fds, 4, timeout);
+  if (n == -1) {
+    if (errno == EINTR)
+      return;
+    die("poll");
+  }
+  if (E.loading)
+    editorLoadUpdate();
+  // add the rows of any chunks indexed in the meantime.
+  if ((fds[2].revents & POLLIN) || E.watch.pending)
+    editorWatchUpdate();
+  if (fds[3].revents & (POLLIN | POLLHUP | POLLERR))
+    editorStreamRead();
+  editorJournalUpdate();
+  // 'j' bytes need no handling below, a finished write of the swap file
+  // only lets this hand over the next one.
+
+  if (n == 0) {
+    // nothing arrived in time.
+    if (E.inhead != E.intail && !E.inpaste)
+      editorDecodeInput(1);
+    // the escape sequence never finished, so it was a lone escape key.
+    else
+      E.redraw = 1;
+    // the status message has expired.
+    return;
+  }
+
+  if (fds[1].revents & POLLIN) {
+    // drain every pending byte, a burst of wakeups is handled once.
+    char buf[64];
+    int resized = 0, saved = 0, indexed = 0, found = 0, written = 0;
+    // 'l' bytes need no handling here, indexed chunks are picked up below.
+    ssize_t nread, j;
+    while ((nread = read(E.wakepipe[0], buf, sizeof(buf))) > 0) {
+      for (j = 0; j < nread; j++) {
+        if (buf[j] == 'w')
+          resized = 1;
+        else if (buf[j] == 's')
+          saved = 1;
+        else if (buf[j] == 'i')
+          indexed = 1;
+        else if (buf[j] == 'f')
+          found = 1;
+        else if (buf[j] == 'o')
+          written = 1;
+      }
+    }
+    if (resized)
+      editorResize();
+    if (saved) {
+      editorSaveUpdate();
+      E.redraw = 1;
+    }
+    if (indexed)
+      editorPagedUpdate();
+    if (found)
+      editorFindUpdate();
+    if (written && E.out.deferred)
+      // a frame was skipped while the last one was written.
+      E.redraw = 1;
+  }
+
+  if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+    if (editorFillInput() == 0 && (fds[0].revents & (POLLHUP | POLLERR)))
+      die("read");
+    // the terminal went away.
+    editorDecodeInput(0);
+  }
+}
+
+/* headless replay */
+void editorMemAddRow(editor_row *row, void *arg) {
+  // This function will add the bytes of a row to a memory report.
+  size_t *text = arg;
+  *text += row->size;
+}
+
+void editorMemReport() {
+  // This function will print what the rows of the buffer cost besides their
+  // text: the nodes holding the rows, the arena blocks of edited rows and
+  // the text blocks, per line.
+  size_t text = 0;
+  bufWalk(E.root, editorMemAddRow, &text);
+  double nodes = (double)bufNodes(E.root) * sizeof(buf_node);
+  double blocks = (double)E.mem.bytes - nodes;
+  double lines = E.numrows > 0 ? E.numrows : 1;
+  printf("mem: lines %d text %.1fMB heap %.1fMB, per line: text %.1f "
+         "rows %.1f arena %.1f text blocks %.1f bytes\n",
+         E.numrows, text / 1048576.0,
+         (E.mem.bytes + E.textbytes) / 1048576.0, text / lines,
+         nodes / lines, blocks / lines, E.textbytes / lines);
+}
+
+void editorReplayFinish() {
+  // This function will end a headless run once the script is used up and
+  // print how long every key took, how much was written, the peak memory
+  // use and what the rows cost.
+  if (E.saving)
+    editorSaveFinish();
+  editorFindStop();
+  double *lat = E.latency;
+  int n = E.nlatency;
+  qsort(lat, n, sizeof(double), editorCompareDouble);
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  // ru_maxrss is the peak resident set size in kilobytes.
+  printf("%s: open %.3fs keys %d p50 %.1fus p99 %.1fus max %.1fus "
+         "bytes %lld rss %ldMB\n",
+         E.script ? E.script : "(no script)", E.opentime, n,
+         n ? lat[n / 2] * 1e6 : 0, n ? lat[(long)n * 99 / 100] * 1e6 : 0,
+         n ? lat[n - 1] * 1e6 : 0, E.outbytes, ru.ru_maxrss / 1024);
+  editorMemReport();
+  exit(0);
+}
+
+void editorReplay(double start) {
+  // This function will run the editor without a terminal. The file is
+  // loaded completely first, then the keys of the script are replayed one
+  // at a time and every key gets a frame of its own, so the time of each
+  // can be measured. start is when opening the file began.
+  editorRefreshScreen();
+  while (E.loading)
+    editorWaitEvent();
+  E.opentime = editorNow() - start;
+
+  if (E.script) {
+    E.infd = open(E.script, O_RDONLY);
+    if (E.infd == -1)
+      die("open");
+  } else {
+    E.inputeof = 1;
+  }
+  while (1) {
+    E.redraw = 0;
+    while (E.nkeys == 0 && !E.redraw)
+      editorWaitEvent();
+    // editorWaitEvent() ends the run when the script is used up.
+    if (E.nkeys == 0) {
+      editorRefreshScreen();
+      continue;
+    }
+    double t = editorNow();
+    editorProcessKey(editorReadKey());
+    if (E.nkeys == 0)
+      editorDecodeInput(0);
+    STATS_TIME(keys, t);
+    editorRefreshScreen();
+    if (E.nlatency == E.latencycap) {
+      E.latencycap = E.latencycap ? E.latencycap * 2 : 4096;
+      E.latency = realloc(E.latency, sizeof(double) * E.latencycap);
+      if (E.latency == NULL)
+        die("realloc");
+    }
+    E.latency[E.nlatency++] = editorNow() - t;
   }
 }
 
@@ -659,27 +7795,230 @@ void initEditor() {
   E.rof = 0;
   E.cof = 0;
   E.numrows = 0;
-  E.row = NULL;
+  E.root = NULL;
+  E.rxidx = NULL;
+  E.nrxidx = 0;
+  E.rxcap = 0;
+  E.rxfree = 0;
+  editorInitKernels();
+  setlocale(LC_CTYPE, "");
+  if (MB_CUR_MAX == 1)
+    setlocale(LC_CTYPE, "C.UTF-8");
+  // rows are UTF-8, even when the environment does not say so.
+  E.map = NULL;
+  E.maplen = 0;
   E.filename = NULL;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
+  E.inhead = 0;
+  E.intail = 0;
+  E.keyhead = 0;
+  E.nkeys = 0;
+  E.inpaste = 0;
+  E.pastequeued = 0;
+  E.paste = NULL;
+  E.pastelen = 0;
+  E.pastecap = 0;
+  E.redraw = 0;
+  E.clearscreen = 0;
+  E.dirty = 0;
+  E.saving = 0;
+  memset(&E.save, 0, sizeof(E.save));
+  pthread_mutex_init(&E.save.lock, NULL);
+  E.loading = 0;
+  memset(&E.load, 0, sizeof(E.load));
+  pthread_mutex_init(&E.load.lock, NULL);
+  pthread_cond_init(&E.load.ready, NULL);
+  E.paged = 0;
+  memset(&E.pager, 0, sizeof(E.pager));
+  E.pager.fd = -1;
+  pthread_mutex_init(&E.pager.lock, NULL);
+  pthread_cond_init(&E.pager.ready, NULL);
+  memset(&E.find, 0, sizeof(E.find));
+  pthread_mutex_init(&E.find.lock, NULL);
+  memset(&E.stream, 0, sizeof(E.stream));
+  E.stream.fd = -1;
+  memset(&E.watch, 0, sizeof(E.watch));
+  E.watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  E.watch.wd = -1;
+  E.watch.dirwd = -1;
+  // without inotify the file is simply not watched.
+  memset(&E.hl, 0, sizeof(E.hl));
+  E.hl.maxrow = -1;
+  int j;
+  for (j = 0; j < HL_SLOTS; j++)
+    E.hl.slots[j].row = -1;
+  memset(&E.out, 0, sizeof(E.out));
+  pthread_mutex_init(&E.out.lock, NULL);
+  pthread_cond_init(&E.out.cond, NULL);
+  memset(&E.stats, 0, sizeof(E.stats));
+  E.stats.start = editorNow();
+  memset(&E.undo, 0, sizeof(E.undo));
+  memset(&E.macro, 0, sizeof(E.macro));
+  E.undo.limit = (size_t)UNDO_DEFAULT_MB * 1024 * 1024;
+  E.undo.dropped = -1;
+  memset(&E.journal, 0, sizeof(E.journal));
+  E.journal.fd = -1;
+  E.journal.off = E.headless;
+  // a headless run is a measurement, its edits are not worth keeping.
+  pthread_mutex_init(&E.journal.lock, NULL);
+  pthread_cond_init(&E.journal.cond, NULL);
+
+  if (pipe2(E.wakepipe, O_CLOEXEC) == -1)
+    die("pipe");
+  if (editorNonblock(E.wakepipe[0]) == -1 ||
+      editorNonblock(E.wakepipe[1]) == -1)
+    die("fcntl");
+  // neither end may block, a full pipe already means a resize is pending.
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = editorHandleSigwinch;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1)
+    die("sigaction");
 
   if (getWindowSize(&E.screenrows, &E.screencols) == -1)
     die("getWindowSize");
   E.screenrows -= 2;
+
+  E.frame = calloc(E.screenrows + 2, sizeof(uint64_t));
+  // one hash for every text row plus the status and message bars.
+  E.framevalid = 0;
+  E.framerof = 0;
+  E.framecof = 0;
+  E.framebytes = 0;
+  char *term = getenv("TERM");
+  E.canscroll = term && *term && strcmp(term, "dumb") != 0;
+  // every terminal but the dumb one understands scroll regions.
 }
 
 int main(int argc, char *argv[]) {
-  enableRawMode();
+  E.infd = STDIN_FILENO;
+  E.outfd = STDOUT_FILENO;
+  if (argc >= 2 && strcmp(argv[1], "--bench-kernels") == 0)
+    // ./cedit --bench-kernels [MB] compares the scanning kernels.
+    return editorBenchKernels(argc >= 3 ? atoi(argv[2]) : 1024);
+
+  int paged = 0;
+  int cachemb = PAGED_DEFAULT_CACHE_MB;
+  int undomb = UNDO_DEFAULT_MB;
+  int follow = 0;
+  int streammb = STREAM_DEFAULT_MB;
+  char *sink = "/dev/null";
+  char *csv = NULL;
+  char *filename = NULL;
+  int j;
+  for (j = 1; j < argc; j++) {
+    if (strcmp(argv[j], "--paged") == 0)
+      // --paged views the file through the page cache instead of loading it.
+      paged = 1;
+    else if (strcmp(argv[j], "--page-cache") == 0 && j + 1 < argc)
+      // --page-cache MB sets the memory limit of the page cache.
+      cachemb = atoi(argv[++j]);
+    else if (strcmp(argv[j], "--undo-mb") == 0 && j + 1 < argc)
+      // --undo-mb MB sets how much memory the undo history may use.
+      undomb = atoi(argv[++j]);
+    else if (strcmp(argv[j], "--headless") == 0 && j + 1 < argc) {
+      // --headless ROWSxCOLS runs without a terminal on a screen that size.
+      E.headless = 1;
+      if (sscanf(argv[++j], "%dx%d", &E.headrows, &E.headcols) != 2 ||
+          E.headrows < 3 || E.headcols < 1) {
+        fprintf(stderr, "--headless wants ROWSxCOLS, like 24x80\n");
+        return 1;
+      }
+    } else if (strcmp(argv[j], "--script") == 0 && j + 1 < argc)
+      // --script FILE replays the keys in FILE, for a headless run.
+      E.script = argv[++j];
+    else if (strcmp(argv[j], "--sink") == 0 && j + 1 < argc)
+      // --sink FILE is where a headless run writes its frames.
+      sink = argv[++j];
+    else if (strcmp(argv[j], "--stream-mb") == 0 && j + 1 < argc)
+      // --stream-mb MB sets how much of a pipe is read before reading stops.
+      streammb = atoi(argv[++j]);
+    else if (strcmp(argv[j], "--follow") == 0)
+      // --follow keeps the end of the file on screen as it grows, Ctrl-E.
+      follow = 1;
+    else if (strcmp(argv[j], "--stats-csv") == 0 && j + 1 < argc)
+      // --stats-csv FILE writes what every frame cost to FILE.
+      csv = argv[++j];
+    else
+      filename = argv[j];
+  }
+  struct stat st;
+  if (filename && !paged && stat(filename, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size / sysconf(_SC_PAGESIZE) > sysconf(_SC_PHYS_PAGES))
+    // a file larger than the memory of the machine cannot be loaded.
+    paged = 1;
+
+  int pipefd = -1;
+  if ((filename && strcmp(filename, "-") == 0) ||
+      (filename == NULL && !E.headless && !isatty(STDIN_FILENO))) {
+    // cedit - reads the file from standard input, the keys then come from
+    // the terminal, which takes the place of standard input.
+    filename = NULL;
+    pipefd = dup(STDIN_FILENO);
+    if (pipefd == -1) {
+      perror("dup");
+      return 1;
+    }
+    if (!E.headless) {
+      int tty = open("/dev/tty", O_RDWR);
+      if (tty == -1 || dup2(tty, STDIN_FILENO) == -1) {
+        perror("/dev/tty");
+        return 1;
+      }
+      close(tty);
+    }
+  }
+
+  double start = editorNow();
+  if (E.headless) {
+    E.infd = -1;
+    E.outfd = open(sink, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (E.outfd == -1) {
+      perror(sink);
+      return 1;
+    }
+  } else {
+    enableRawMode();
+  }
   initEditor();
-  if (argc >= 2) {
-    editorOpen(argv[1]);
+  E.undo.limit = (size_t)undomb * 1024 * 1024;
+  E.watch.follow = follow;
+  if (csv) {
+    E.stats.csv = fopen(csv, "w");
+    if (E.stats.csv == NULL)
+      die("fopen");
+    fprintf(E.stats.csv, "frame,seconds,keys_us,draw_us,write_us,rows_drawn,"
+                         "rows_sent,bytes,allocs\n");
+    // exit() flushes the file.
   }
+  if (filename && paged)
+    editorOpenPaged(filename, cachemb);
+  else if (filename)
+    editorOpen(filename);
+  else if (pipefd != -1)
+    editorOpenPipe(pipefd, streammb);
+  editorSelectSyntax();
+  if (filename)
+    editorWatchStart(paged ? E.pager.size : (off_t)E.maplen);
+  if (E.watch.follow)
+    editorWatchFollow();
 
-  editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit");
+  editorSetStatusMessage(
+      "HELP: Ctrl-S save | Ctrl-Q quit | Ctrl-F find | Ctrl-R replace | "
+      "Ctrl-Z undo");
 
+  if (E.headless)
+    editorReplay(start);
+  editorOutputStart();
   while (1) {
     editorRefreshScreen();
+    E.redraw = 0;
+    while (E.nkeys == 0 && !E.redraw)
+      editorWaitEvent();
+    // sleep until there is a key to process or a reason to redraw.
     editorProcessKeypress();
   };
   return 0;